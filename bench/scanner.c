@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "scanner.h"
+
+// scans a source file repeatedly and reports scanner throughput
+// usage: scanner_bench [path] [iterations]
+
+static const char *sample =
+    "// generated sample\n"
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "var message = \"the quick brown fox jumps over the lazy dog\";\n"
+    "for (var i = 0; i < 100; i = i + 1) { print message + \"!\"; }\n"
+    "while (false) { var total = 3.14159 * 2.71828; }\n";
+
+static char *generateSource(size_t *size)
+{
+    size_t sampleLength = strlen(sample);
+    size_t copies = (8 * 1024 * 1024) / sampleLength;
+    char *buffer = malloc(copies * sampleLength + 1);
+    if (buffer == NULL)
+        exit(74);
+    for (size_t i = 0; i < copies; i++)
+    {
+        memcpy(buffer + i * sampleLength, sample, sampleLength);
+    }
+    *size = copies * sampleLength;
+    buffer[*size] = '\0';
+    return buffer;
+}
+
+static char *readSource(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char *buffer = malloc(*size + 1);
+    if (buffer == NULL || fread(buffer, 1, *size, file) < *size)
+    {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[*size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+int main(int argc, const char *argv[])
+{
+    size_t size;
+    char *source = argc > 1 ? readSource(argv[1], &size) : generateSource(&size);
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    long tokens = 0;
+    Scanner scanner;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+    {
+        initScanner(&scanner, source, 1);
+        for (;;)
+        {
+            Token token = scanToken(&scanner);
+            tokens++;
+            if (token.type == TOKEN_EOF)
+                break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double megabytes = (double)size * iterations / (1024 * 1024);
+    printf("scanned %.1f MB, %ld tokens in %.3f s: %.1f MB/s\n",
+           megabytes, tokens, seconds, megabytes / seconds);
+
+    free(source);
+    return 0;
+}
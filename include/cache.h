@@ -0,0 +1,21 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+// bump whenever the bytecode or the cache layout changes
+#define CACHE_VERSION 2
+
+typedef struct
+{
+    void *region;
+    size_t size;
+} CacheImage;
+
+uint64_t hashSource(const char *source, size_t *length);
+bool writeCache(VM *vm, const char *path, ObjFunction *script, uint64_t sourceHash, size_t sourceLength);
+ObjFunction *loadCache(VM *vm, const char *path, uint64_t sourceHash, size_t sourceLength, CacheImage *image);
+void closeCache(CacheImage *image);
+
+#endif
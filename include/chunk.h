@@ -26,6 +26,12 @@ typedef enum
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_MODULO,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
@@ -36,6 +42,21 @@ typedef enum
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    // unchecked variants emitted when the compiler proves both operands are
+    // numbers and the result is a double, so at least one of them is
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_NUM,
+    // and when both operands are proven integers
+    OP_GREATER_INT,
+    OP_LESS_INT,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
 } OpCode;
 
 typedef struct
@@ -7,6 +7,8 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_VERIFY_TYPES
+// #define HASH_SIPHASH
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
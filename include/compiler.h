@@ -4,6 +4,10 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction *compile(const char *source);
+ObjFunction *compile(VM *vm, const char *source, bool lazy);
+bool compileLazy(VM *vm, ObjFunction *function);
+// specialises arithmetic on operands proven to be numbers, for bytecode
+// that didn't come straight from the compiler
+void inferNumericTypes(ObjFunction *function);
 
 #endif
@@ -0,0 +1,9 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+void seedHash();
+uint32_t hashString(const char *key, int length);
+
+#endif
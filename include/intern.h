@@ -0,0 +1,30 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+// a slot keeps its string's hash and length next to the pointer, so a probe
+// only follows the pointer when both already match. empty slots have a NULL key
+typedef struct
+{
+    ObjString *key;
+    uint32_t hash;
+    int length;
+} InternSlot;
+
+// open addressing with linear probing over a power of two capacity. strings
+// are never removed, so there are no tombstones
+typedef struct
+{
+    int count;
+    int capacity;
+    InternSlot *slots;
+} InternSet;
+
+void initInternSet(InternSet *set);
+void freeInternSet(InternSet *set);
+ObjString *internSetFind(InternSet *set, const char *chars, int length, uint32_t hash);
+void internSetAdd(InternSet *set, ObjString *string);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "object.h"
+
+// slots in a channel made without an explicit capacity
+#define CHANNEL_DEFAULT_CAPACITY 64
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+
+Channel *createChannel(int capacity);
+void releaseChannel(Channel *channel);
+bool channelSend(Channel *channel, Value value);
+Value channelReceive(VM *vm, Channel *channel);
+
+Isolate *spawnIsolate(VM *vm, ObjClosure *closure, int argCount, Value *args);
+Value joinIsolate(VM *vm, Isolate *isolate);
+void freeIsolate(Isolate *isolate);
+
+#endif
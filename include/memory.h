@@ -20,6 +20,7 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void freeFiber(Fiber *fiber);
+void freeObjects(Obj *objects);
 
 #endif
@@ -1,9 +1,34 @@
 #ifndef clox_natives_h
 #define clox_natives_h
 
-#include "value.h"
+#include "object.h"
 
-Value n_clock(int argCount, Value *args);
-Value n_triple(int argCount, Value *args);
+typedef struct
+{
+    const char *name;
+    NativeFn function;
+} NativeDef;
+
+// every native the vm defines, terminated by an entry with no name
+extern const NativeDef nativeDefs[];
+
+const NativeDef *findNative(const char *name);
+
+Value n_clock(VM *vm, int argCount, Value *args);
+Value n_triple(VM *vm, int argCount, Value *args);
+Value n_substr(VM *vm, int argCount, Value *args);
+Value n_indexOf(VM *vm, int argCount, Value *args);
+Value n_split(VM *vm, int argCount, Value *args);
+Value n_str(VM *vm, int argCount, Value *args);
+Value n_spawn(VM *vm, int argCount, Value *args);
+Value n_join(VM *vm, int argCount, Value *args);
+Value n_channel(VM *vm, int argCount, Value *args);
+Value n_send(VM *vm, int argCount, Value *args);
+Value n_recv(VM *vm, int argCount, Value *args);
+Value n_coroutine(VM *vm, int argCount, Value *args);
+Value n_resume(VM *vm, int argCount, Value *args);
+Value n_yield(VM *vm, int argCount, Value *args);
+Value n_next(VM *vm, int argCount, Value *args);
+Value n_done(VM *vm, int argCount, Value *args);
 
 #endif
@@ -0,0 +1,15 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+double parseNumber(const char *start, int length);
+bool parseInteger(const char *start, int length, int64_t *value);
+
+// room for any number formatNumber or formatInteger writes, without a NUL
+#define NUMBER_TEXT_MAX 32
+
+int formatNumber(double value, char *buffer);
+int formatInteger(int64_t value, char *buffer);
+
+#endif
@@ -7,23 +7,42 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
-#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE);
-#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE);
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_SLICE(value) isObjType(value, OBJ_SLICE)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define IS_ISOLATE(value) isObjType(value, OBJ_ISOLATE)
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
+
+// any string value, whatever its representation
+#define IS_TEXT(value) \
+    (IS_SMALL_STRING(value) || IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value))
 
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_SLICE(value) ((ObjSlice *)AS_OBJ(value))
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
+#define AS_ISOLATE(value) (((ObjIsolate *)AS_OBJ(value))->isolate)
+#define AS_COROUTINE(value) ((ObjCoroutine *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 #define AS_NATIVE_OBJ(value) (((ObjNative *)AS_OBJ(value)))
 
 typedef enum
 {
+    OBJ_CHANNEL,
     OBJ_CLOSURE,
+    OBJ_COROUTINE,
     OBJ_FUNCTION,
+    OBJ_ISOLATE,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SLICE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
@@ -31,6 +50,7 @@ typedef enum
 struct Obj
 {
     ObjType type;
+    bool frozen; // belongs to a shared Program, so never written again
     struct Obj *next;
 };
 
@@ -39,11 +59,16 @@ typedef struct
     Obj obj;
     int arity;
     int upvalueCount;
+    int stackSize; // deepest its frame's stack gets, slots included
     Chunk chunk;
     ObjString *name;
+    // set while the body has been skipped by a lazy compile
+    const char *lazySource;
+    int lazyLine;
+    ObjString **upvalueNames;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
 
 typedef struct
 {
@@ -52,14 +77,41 @@ typedef struct
     const char *name;
 } ObjNative;
 
+// identifiers and constants are interned, so two of them are equal only if
+// they are the same object. strings built at runtime are not, and hash
+// themselves the first time something asks
 struct ObjString
 {
     Obj obj;
     int length;
-    uint32_t hash;
+    uint32_t hash; // 0 until computed
+    bool interned;
     char chars[];
 };
 
+// concatenations at least this long build a rope instead of copying
+#define ROPE_MIN_LENGTH 64
+
+// the deferred concatenation of two strings or ropes. the contents are
+// only copied out once something looks at them
+typedef struct
+{
+    Obj obj;
+    int length;
+    Obj *left;
+    Obj *right;
+    ObjString *flat; // owned by the rope, not on the vm's object list
+} ObjRope;
+
+// length bytes of a flat parent string from start on, without a copy
+typedef struct
+{
+    Obj obj;
+    int start;
+    int length;
+    ObjString *parent;
+} ObjSlice;
+
 typedef struct ObjUpvalue
 {
     Obj obj;
@@ -76,19 +128,113 @@ typedef struct
     int upvalueCount;
 } ObjClosure;
 
-ObjClosure *newClosure(ObjFunction *function);
-ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function, const char *name);
-uint32_t hashString(const char *key, int length);
-ObjString *internString(ObjString *string);
-ObjString *makeString(int length);
-ObjString *copyString(const char *chars, int length);
-ObjUpvalue *newUpvalue(Value *slot);
-void printObject(Value value);
+typedef struct CallFrame CallFrame;
+
+// a call stack and how far along it the code has got. the vm runs on one at
+// a time, and switches by saving its registers into one and loading another.
+// a coroutine's stacks start small and grow as its calls need them, the
+// capacities aren't registers and stay put
+typedef struct
+{
+    CallFrame *frames;
+    int frameCount;
+    Value *stack;
+    Value *stackTop;
+    ObjUpvalue *openUpvalues;
+    int frameCapacity;
+    int stackCapacity;
+} Fiber;
+
+typedef enum
+{
+    COROUTINE_SUSPENDED, // not started yet or stopped at a yield
+    COROUTINE_RUNNING,   // running, or waiting on a coroutine it resumed
+    COROUTINE_DONE
+} CoroutineState;
+
+// a function running on a stack of its own that it can yield from
+typedef struct ObjCoroutine
+{
+    Obj obj;
+    CoroutineState state;
+    bool started;
+    bool pulled;                   // resumed by next(), which drops the final return
+    struct ObjCoroutine *resumer;  // NULL when the main program resumed it
+    Fiber fiber;                   // its stacks while it isn't running
+} ObjCoroutine;
+
+typedef struct Channel Channel;
+typedef struct Isolate Isolate;
+
+// this vm's handle on a channel, other isolates hold handles of their own
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+// a closure running in a vm of its own on another thread
+typedef struct
+{
+    Obj obj;
+    Isolate *isolate;
+} ObjIsolate;
+
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+ObjFunction *newFunction(VM *vm);
+ObjNative *newNative(VM *vm, NativeFn function, const char *name);
+ObjString *internString(VM *vm, ObjString *string);
+ObjString *makeString(VM *vm, int length);
+ObjString *copyString(VM *vm, const char *chars, int length);
+uint32_t stringHash(ObjString *string);
+bool stringsEqual(ObjString *a, ObjString *b);
+Value copyText(VM *vm, const char *chars, int length);
+ObjRope *newRope(VM *vm, Value left, Value right, int length);
+ObjString *flattenRope(ObjRope *rope);
+ObjSlice *newSlice(VM *vm, Value text, int start, int length);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
+ObjCoroutine *newCoroutine(VM *vm, ObjClosure *closure);
+ObjChannel *newChannel(VM *vm, Channel *channel);
+ObjIsolate *newIsolate(VM *vm, Isolate *isolate);
+void printObject(FILE *out, Value value);
 
 static inline bool isObjType(Value value, ObjType type)
 {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline int textLength(Value value)
+{
+    if (IS_SMALL_STRING(value))
+        return smallLength(value);
+
+    switch (OBJ_TYPE(value))
+    {
+    case OBJ_ROPE:
+        return AS_ROPE(value)->length;
+    case OBJ_SLICE:
+        return AS_SLICE(value)->length;
+    default:
+        return AS_STRING(value)->length;
+    }
+}
+
+// the bytes of any string value, not necessarily terminated. a small
+// string's bytes are inside *value, and a rope is flattened on first use
+static inline const char *textChars(const Value *value)
+{
+    if (IS_SMALL_STRING(*value))
+        return value->as.small;
+
+    switch (OBJ_TYPE(*value))
+    {
+    case OBJ_ROPE:
+        return flattenRope(AS_ROPE(*value))->chars;
+    case OBJ_SLICE:
+        return AS_SLICE(*value)->parent->chars + AS_SLICE(*value)->start;
+    default:
+        return AS_STRING(*value)->chars;
+    }
+}
+
 #endif
@@ -0,0 +1,16 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// the size of the blocks stdout is written out in
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+// full blocks queued for the writer thread before print waits for it
+#define OUTPUT_QUEUE_MAX 8
+
+FILE *openOutput(bool async);
+void closeOutput();
+
+#endif
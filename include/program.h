@@ -0,0 +1,27 @@
+#ifndef clox_program_h
+#define clox_program_h
+
+#include "cache.h"
+#include "common.h"
+#include "vm.h"
+
+// a script compiled once for any number of vms to run at the same time, on
+// any threads. it owns the functions, their constants and the strings they
+// intern, and nothing in it is written after it is made. each vm keeps its
+// own globals and heap
+struct Program
+{
+    ObjFunction *script;
+    Obj *objects;
+    InternSet strings;
+    void *sealed; // read-only pages holding every chunk, once sealed
+    size_t sealedSize;
+};
+
+bool compileProgram(Program *program, const char *source);
+bool loadProgram(Program *program, const char *path, uint64_t sourceHash, size_t sourceLength,
+                 CacheImage *image);
+bool sealProgram(Program *program);
+void freeProgram(Program *program);
+
+#endif
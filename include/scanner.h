@@ -14,6 +14,10 @@ typedef enum
     TOKEN_SEMICOLON,
     TOKEN_SLASH,
     TOKEN_STAR,
+    TOKEN_PERCENT,
+    TOKEN_AMPERSAND,
+    TOKEN_PIPE,
+    TOKEN_CARET,
     TOKEN_BANG,
     TOKEN_BANG_EQUAL,
     TOKEN_EQUAL,
@@ -22,6 +26,8 @@ typedef enum
     TOKEN_GREATER_EQUAL,
     TOKEN_LESS,
     TOKEN_LESS_EQUAL,
+    TOKEN_LESS_LESS,
+    TOKEN_GREATER_GREATER,
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
     TOKEN_NUMBER,
@@ -53,7 +59,14 @@ typedef struct
     int line;
 } Token;
 
-void initScanner(const char *source);
-Token scanToken();
+typedef struct
+{
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source, int line);
+Token scanToken(Scanner *scanner);
 
 #endif
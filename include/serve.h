@@ -0,0 +1,9 @@
+#ifndef clox_serve_h
+#define clox_serve_h
+
+#include "common.h"
+#include "program.h"
+
+void serve(const char *path, Program *prelude, int workers, int64_t fuel);
+
+#endif
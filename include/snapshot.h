@@ -0,0 +1,20 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+#include "value.h"
+
+// bump whenever the image layout changes
+#define SNAPSHOT_VERSION 7
+
+typedef struct
+{
+    void *region;
+    size_t size;
+} SnapshotImage;
+
+bool writeSnapshot(VM *vm, const char *path);
+bool loadSnapshot(VM *vm, const char *path, SnapshotImage *image);
+void closeSnapshot(SnapshotImage *image);
+
+#endif
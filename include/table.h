@@ -10,19 +10,25 @@ typedef struct
     Value value;
 } Entry;
 
+// open addressing with a control byte per slot, probed a group of
+// TABLE_GROUP_WIDTH slots at a time. empty and deleted slots have a NULL key.
+// keys are compared by pointer, so they must be interned strings
 typedef struct
 {
     int count;
-    int capacity;
+    int tombstones;
+    int capacity; // zero or a power of two no smaller than a group
+    uint8_t *control;
     Entry *entries;
 } Table;
 
+#define TABLE_GROUP_WIDTH 16
+
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
-ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
 #endif
@@ -1,21 +1,30 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
 
 typedef enum
 {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ,
+    VAL_SMALL_STRING,
     VAL_ERROR_ARGC, // used to communicate errors to the vm when running native functions
-    VAL_ERROR_ARGV  //
+    VAL_ERROR_ARGV, //
+    VAL_SWITCHED    // a native moved the vm onto another coroutine's stack
 } ValueType;
 
+// strings up to this long are kept in the value itself, padded with NULs
+#define SMALL_STRING_MAX 8
+
 typedef struct
 {
     ValueType type;
@@ -23,28 +32,41 @@ typedef struct
     {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
+        char small[SMALL_STRING_MAX];
     } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_SMALL_STRING(value) ((value).type == VAL_SMALL_STRING)
 #define IS_ERR_ARGC(value) ((value).type == VAL_ERROR_ARGC)
 #define IS_ERR_ARGV(value) ((value).type == VAL_ERROR_ARGV)
+#define IS_SWITCHED(value) ((value).type == VAL_SWITCHED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
 #define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define ERROR_ARGC ((Value){VAL_ERROR_ARGC, {.number = 0}})
 #define ERROR_ARGV ((Value){VAL_ERROR_ARGV, {.number = 0}})
+#define SWITCHED ((Value){VAL_SWITCHED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+// either kind of number. AS_FLOAT promotes an integer to a double, and is
+// a function so its operand is only evaluated once
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+#define AS_FLOAT(value) asFloat(value)
+
 typedef struct
 {
     int capacity;
@@ -52,10 +74,24 @@ typedef struct
     Value *values;
 } ValueArray;
 
+static inline double asFloat(Value value)
+{
+    return IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value);
+}
+
+static inline int smallLength(Value value)
+{
+    int length = 0;
+    while (length < SMALL_STRING_MAX && value.as.small[length] != '\0')
+        length++;
+    return length;
+}
+
+bool makeSmallString(const char *chars, int length, Value *value);
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
-void printValue(Value value);
+void printValue(FILE *out, Value value);
 
 #endif
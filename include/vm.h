@@ -2,14 +2,24 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "intern.h"
 #include "table.h"
 #include "value.h"
 #include "object.h"
 
+typedef struct Program Program;
+
+// fuel for a vm the host doesn't meter, which never runs out
+#define FUEL_UNLIMITED INT64_MAX
+
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct
+// what a coroutine's stacks start with, they double up to the maximums
+#define FIBER_FRAMES_MIN 4
+#define FIBER_STACK_MIN 32
+
+typedef struct CallFrame
 {
     ObjClosure *closure;
     ObjFunction *function;
@@ -17,32 +27,51 @@ typedef struct
     Value *slots;
 } CallFrame;
 
-typedef struct
+struct VM
 {
-    CallFrame frames[FRAMES_MAX];
+    // the stacks being run on, the main program's or a coroutine's
+    CallFrame *frames;
     int frameCount;
-
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
-    Table globals;
-    Table strings;
     ObjUpvalue *openUpvalues;
+    int64_t fuel;        // loop back-edges and calls left before run() stops
+    int64_t isolateFuel; // what each isolate it spawns starts with
+
+    ObjCoroutine *coroutine; // the one running, NULL for the main program
+    Fiber main;              // the main program's stacks while it waits on one
+
+    Program *program; // shared compiled code, NULL when the vm compiled its own
+    FILE *out;        // where print writes
+    FILE *err;        // where compile and runtime errors are reported
+    Table globals;
+    InternSet strings;
     Obj *objects;
-} VM;
+
+    CallFrame mainFrames[FRAMES_MAX];
+    Value mainStack[STACK_MAX];
+};
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPERT_RUNTIME_ERROR,
+    INTERPRET_OUT_OF_FUEL, // stopped, resumeInterpret() carries on
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop();
+void initVM(VM *vm, Program *program);
+void defineNatives(VM *vm);
+void freeVM(VM *vm);
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+InterpretResult resumeInterpret(VM *vm);
+void abandonInterpret(VM *vm);
+InterpretResult interpretCall(VM *vm, int argCount, Value *result);
+int exitStatus(InterpretResult result);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
+bool resumeCoroutine(VM *vm, ObjCoroutine *coroutine, Value value, bool pulled, Value *callee);
+bool yieldCoroutine(VM *vm, Value value, Value *callee);
 
 #endif
@@ -0,0 +1,744 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+
+// a cache file is a header followed by one record per function. nested
+// functions come before the functions that use them, so the script is last.
+// every record is padded to 8 bytes and the code and line tables of a record
+// are used in place from the mapped file. nothing in the file is trusted:
+// each function's bytecode is verified before it is handed to the vm, and
+// any failure makes the caller compile the source instead. the unchecked
+// numeric opcodes are turned back into checked ones and only come back
+// where inferNumericTypes() proves them again
+
+#define CACHE_MAGIC "LOXC"
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint32_t functionCount;
+    uint32_t pad;
+} CacheHeader;
+
+typedef struct
+{
+    int32_t arity;
+    int32_t upvalueCount;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    int32_t nameLength; // -1 for the script
+} FunctionRecord;
+
+typedef enum
+{
+    CONST_NIL,
+    CONST_FALSE,
+    CONST_TRUE,
+    CONST_NUMBER,
+    CONST_INT,
+    CONST_STRING,
+    CONST_FUNCTION,
+} ConstantTag;
+
+uint64_t hashSource(const char *source, size_t *length)
+{
+    uint64_t hash = 14695981039346656037u;
+    const char *c = source;
+    for (; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211u;
+    }
+    *length = (size_t)(c - source);
+    return hash;
+}
+
+typedef struct
+{
+    VM *vm; // compiles any bodies still skipped
+    FILE *file;
+    ObjFunction **functions;
+    int count;
+    int capacity;
+    bool failed;
+} CacheWriter;
+
+static void writeBytes(CacheWriter *writer, const void *bytes, size_t size)
+{
+    if (size > 0 && fwrite(bytes, 1, size, writer->file) != size)
+        writer->failed = true;
+}
+
+static void writePadding(CacheWriter *writer, size_t size)
+{
+    static const uint8_t zeros[8] = {0};
+    writeBytes(writer, zeros, ALIGN8(size) - size);
+}
+
+static void writeString(CacheWriter *writer, ObjString *string)
+{
+    uint32_t length = (uint32_t)string->length;
+    writeBytes(writer, &length, sizeof(length));
+    writeBytes(writer, string->chars, length);
+    writePadding(writer, sizeof(length) + length);
+}
+
+static int functionIndex(CacheWriter *writer, ObjFunction *function)
+{
+    for (int i = 0; i < writer->count; i++)
+    {
+        if (writer->functions[i] == function)
+            return i;
+    }
+    return -1;
+}
+
+static void writeFunction(CacheWriter *writer, ObjFunction *function)
+{
+    // the cache only holds complete bytecode, compile whatever a lazy run skipped
+    if (function->lazySource != NULL && !compileLazy(writer->vm, function))
+    {
+        writer->failed = true;
+        return;
+    }
+
+    Chunk *chunk = &function->chunk;
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant))
+            writeFunction(writer, AS_FUNCTION(constant));
+    }
+
+    FunctionRecord record;
+    record.arity = function->arity;
+    record.upvalueCount = function->upvalueCount;
+    record.codeCount = (uint32_t)chunk->count;
+    record.lineCount = (uint32_t)chunk->lineCount;
+    record.constantCount = (uint32_t)chunk->constants.count;
+    record.nameLength = function->name == NULL ? -1 : function->name->length;
+    writeBytes(writer, &record, sizeof(record));
+    if (function->name != NULL)
+    {
+        writeBytes(writer, function->name->chars, function->name->length);
+        writePadding(writer, function->name->length);
+    }
+
+    writeBytes(writer, chunk->code, chunk->count);
+    writePadding(writer, chunk->count);
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        uint64_t tag;
+        if (IS_NIL(constant))
+        {
+            tag = CONST_NIL;
+            writeBytes(writer, &tag, sizeof(tag));
+        }
+        else if (IS_BOOL(constant))
+        {
+            tag = AS_BOOL(constant) ? CONST_TRUE : CONST_FALSE;
+            writeBytes(writer, &tag, sizeof(tag));
+        }
+        else if (IS_NUMBER(constant))
+        {
+            tag = CONST_NUMBER;
+            double number = AS_NUMBER(constant);
+            writeBytes(writer, &tag, sizeof(tag));
+            writeBytes(writer, &number, sizeof(number));
+        }
+        else if (IS_INT(constant))
+        {
+            tag = CONST_INT;
+            int64_t integer = AS_INT(constant);
+            writeBytes(writer, &tag, sizeof(tag));
+            writeBytes(writer, &integer, sizeof(integer));
+        }
+        else if (IS_STRING(constant))
+        {
+            tag = CONST_STRING;
+            writeBytes(writer, &tag, sizeof(tag));
+            writeString(writer, AS_STRING(constant));
+        }
+        else if (IS_FUNCTION(constant))
+        {
+            tag = CONST_FUNCTION;
+            uint64_t index = (uint64_t)functionIndex(writer, AS_FUNCTION(constant));
+            writeBytes(writer, &tag, sizeof(tag));
+            writeBytes(writer, &index, sizeof(index));
+        }
+        else
+        {
+            writer->failed = true;
+        }
+    }
+
+    if (writer->count == writer->capacity)
+    {
+        int oldCapacity = writer->capacity;
+        writer->capacity = GROW_CAPACITY(oldCapacity);
+        writer->functions = GROW_ARRAY(ObjFunction *, writer->functions,
+                                       oldCapacity, writer->capacity);
+    }
+    writer->functions[writer->count++] = function;
+}
+
+bool writeCache(VM *vm, const char *path, ObjFunction *script, uint64_t sourceHash, size_t sourceLength)
+{
+    // write a file of our own next to the target and rename it, so readers
+    // never see a partial file and two writers never share one
+    size_t pathLength = strlen(path);
+    char *tempPath = ALLOCATE(char, pathLength + 8);
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".XXXXXX", 8);
+    int fd = mkstemp(tempPath);
+
+    CacheWriter writer;
+    writer.vm = vm;
+    writer.file = NULL;
+    if (fd != -1)
+    {
+        // mkstemp() leaves the file readable by its owner only
+        fchmod(fd, 0644);
+        writer.file = fdopen(fd, "wb");
+        if (writer.file == NULL)
+        {
+            close(fd);
+            remove(tempPath);
+        }
+    }
+    writer.functions = NULL;
+    writer.count = 0;
+    writer.capacity = 0;
+    writer.failed = writer.file == NULL;
+
+    if (!writer.failed)
+    {
+        CacheHeader header;
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.sourceHash = sourceHash;
+        header.sourceLength = sourceLength;
+        header.functionCount = 0;
+        header.pad = 0;
+        writeBytes(&writer, &header, sizeof(header));
+        writeFunction(&writer, script);
+
+        header.functionCount = (uint32_t)writer.count;
+        if (fseek(writer.file, 0L, SEEK_SET) != 0)
+            writer.failed = true;
+        writeBytes(&writer, &header, sizeof(header));
+        if (fclose(writer.file) != 0)
+            writer.failed = true;
+
+        if (writer.failed || rename(tempPath, path) != 0)
+        {
+            remove(tempPath);
+            writer.failed = true;
+        }
+    }
+
+    FREE_ARRAY(ObjFunction *, writer.functions, writer.capacity);
+    FREE_ARRAY(char, tempPath, pathLength + 8);
+    return !writer.failed;
+}
+
+typedef struct
+{
+    const uint8_t *current;
+    const uint8_t *end;
+    VM *vm; // owns the functions and strings read back
+    bool failed;
+} CacheReader;
+
+static const void *readBytes(CacheReader *reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < ALIGN8(size))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    const void *bytes = reader->current;
+    reader->current += ALIGN8(size);
+    return bytes;
+}
+
+static uint64_t readWord(CacheReader *reader)
+{
+    const uint64_t *word = readBytes(reader, sizeof(uint64_t));
+    return word == NULL ? 0 : *word;
+}
+
+static ObjString *readString(CacheReader *reader)
+{
+    if (reader->failed || reader->end - reader->current < (ptrdiff_t)sizeof(uint32_t))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    uint32_t length;
+    memcpy(&length, reader->current, sizeof(length));
+    const char *chars = readBytes(reader, sizeof(length) + (size_t)length);
+    if (chars == NULL)
+        return NULL;
+
+    // left uninterned and unhashed like a runtime string, verifyFunction()
+    // interns the ones the code uses as global names
+    ObjString *string = makeString(reader->vm, (int)length);
+    memcpy(string->chars, chars + sizeof(length), length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjFunction *readFunction(CacheReader *reader, ObjFunction **functions, int loaded)
+{
+    const FunctionRecord *record = readBytes(reader, sizeof(FunctionRecord));
+    if (record == NULL)
+        return NULL;
+
+    ObjFunction *function = newFunction(reader->vm);
+    function->arity = record->arity;
+    function->upvalueCount = record->upvalueCount;
+    if (record->nameLength >= 0)
+    {
+        const char *name = readBytes(reader, (size_t)record->nameLength);
+        if (name == NULL)
+            return NULL;
+        function->name = copyString(reader->vm, name, record->nameLength);
+    }
+
+    // code and lines are borrowed, a chunk with no capacity never frees them
+    Chunk *chunk = &function->chunk;
+    chunk->code = (uint8_t *)readBytes(reader, record->codeCount);
+    chunk->count = (int)record->codeCount;
+    chunk->lines = (LineStart *)readBytes(reader, sizeof(LineStart) * record->lineCount);
+    chunk->lineCount = (int)record->lineCount;
+
+    for (uint32_t i = 0; i < record->constantCount && !reader->failed; i++)
+    {
+        switch (readWord(reader))
+        {
+        case CONST_NIL:
+            writeValueArray(&chunk->constants, NIL_VAL);
+            break;
+        case CONST_FALSE:
+            writeValueArray(&chunk->constants, BOOL_VAL(false));
+            break;
+        case CONST_TRUE:
+            writeValueArray(&chunk->constants, BOOL_VAL(true));
+            break;
+        case CONST_NUMBER:
+        {
+            const double *number = readBytes(reader, sizeof(double));
+            if (number != NULL)
+                writeValueArray(&chunk->constants, NUMBER_VAL(*number));
+            break;
+        }
+        case CONST_INT:
+        {
+            const int64_t *integer = readBytes(reader, sizeof(int64_t));
+            if (integer != NULL)
+                writeValueArray(&chunk->constants, INT_VAL(*integer));
+            break;
+        }
+        case CONST_STRING:
+        {
+            ObjString *string = readString(reader);
+            if (string != NULL)
+                writeValueArray(&chunk->constants, OBJ_VAL(string));
+            break;
+        }
+        case CONST_FUNCTION:
+        {
+            uint64_t index = readWord(reader);
+            if (index >= (uint64_t)loaded)
+                reader->failed = true;
+            else
+                writeValueArray(&chunk->constants, OBJ_VAL(functions[index]));
+            break;
+        }
+        default:
+            reader->failed = true;
+            break;
+        }
+    }
+
+    return reader->failed ? NULL : function;
+}
+
+// a name operand has to be a string, interned so the globals table finds it
+static bool verifyName(VM *vm, Chunk *chunk, uint8_t constant)
+{
+    if (constant >= chunk->constants.count || !IS_STRING(chunk->constants.values[constant]))
+        return false;
+    Value *name = &chunk->constants.values[constant];
+    *name = OBJ_VAL(internString(vm, AS_STRING(*name)));
+    return true;
+}
+
+// the checked opcode an unchecked numeric one was specialised from
+static uint8_t checkedOpcode(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_GREATER_NUM:
+    case OP_GREATER_INT:
+        return OP_GREATER;
+    case OP_LESS_NUM:
+    case OP_LESS_INT:
+        return OP_LESS;
+    case OP_ADD_NUM:
+    case OP_ADD_INT:
+        return OP_ADD;
+    case OP_SUBTRACT_NUM:
+    case OP_SUBTRACT_INT:
+        return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+    case OP_MULTIPLY_INT:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+        return OP_DIVIDE;
+    case OP_NEGATE_NUM:
+        return OP_NEGATE;
+    default:
+        return instruction;
+    }
+}
+
+// how many bytes the instruction at offset takes, -1 when it isn't a checked
+// opcode or runs past the end of the code
+static int instructionLength(Chunk *chunk, int offset)
+{
+    int length = 1;
+    switch (chunk->code[offset])
+    {
+    case OP_POPN:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CALL:
+        length = 2;
+        break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        length = 3;
+        break;
+    case OP_CLOSURE:
+    {
+        if (offset + 2 > chunk->count)
+            return -1;
+        uint8_t constant = chunk->code[offset + 1];
+        if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant]))
+            return -1;
+        length = 2 + 2 * AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+        break;
+    }
+    default:
+        if (chunk->code[offset] > OP_RETURN)
+            return -1;
+        break;
+    }
+    return offset + length <= chunk->count ? length : -1;
+}
+
+// follows every path through the code from its entry and checks each
+// instruction as run() will execute it: operands in range, jumps onto code,
+// and a stack height that is the same on every path to an instruction,
+// never drops below what the instruction pops and never passes UINT8_COUNT,
+// the share of the stack each frame is sized for. the deepest it gets is
+// the function's stack size
+static bool verifyFunction(VM *vm, ObjFunction *function, bool script)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    if (count == 0 || function->arity < 0 || function->arity > UINT8_MAX ||
+        function->upvalueCount < 0 || function->upvalueCount > UINT8_MAX ||
+        (script && (function->arity != 0 || function->upvalueCount != 0)) ||
+        // errors name the function being called, only the script has none
+        (function->name == NULL) != script)
+    {
+        return false;
+    }
+
+    // getLine() needs the first instruction covered and offsets in order
+    if (chunk->lineCount == 0 || chunk->lines[0].offset != 0)
+        return false;
+    for (int i = 1; i < chunk->lineCount; i++)
+    {
+        if (chunk->lines[i].offset <= chunk->lines[i - 1].offset || chunk->lines[i].offset >= count)
+            return false;
+    }
+
+    // inferNumericTypes() walks the code in a straight line, dead code
+    // included, so it has to decode that way and paths may only land where
+    // that walk puts an instruction. -1 for an instruction no path has
+    // reached yet, -2 for an operand byte
+    int *heights = ALLOCATE(int, count);
+    int *pending = ALLOCATE(int, count);
+    bool valid = true;
+    for (int offset = 0; offset < count && valid;)
+    {
+        chunk->code[offset] = checkedOpcode(chunk->code[offset]);
+        int length = instructionLength(chunk, offset);
+        valid = length != -1;
+        heights[offset] = -1;
+        for (int i = 1; i < length; i++)
+            heights[offset + i] = -2;
+        offset += valid ? length : 0;
+    }
+    int pendingCount = 0;
+    heights[0] = function->arity + 1;
+    pending[pendingCount++] = 0;
+    int maxHeight = heights[0];
+
+    while (valid && pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        const uint8_t *code = &chunk->code[offset];
+        int height = heights[offset];
+        int length = instructionLength(chunk, offset);
+        int pops = 0;
+        int pushes = 0;
+        int target = -1;       // where a jump goes
+        bool fallsThrough = true;
+
+        switch (code[0])
+        {
+        case OP_CONSTANT:
+            valid = code[1] < chunk->constants.count;
+            pushes = 1;
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            pushes = 1;
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            pops = 1;
+            break;
+        case OP_POPN:
+            pops = code[1];
+            break;
+        case OP_GET_LOCAL:
+            valid = code[1] < height && (code[1] > 0 || !script);
+            pushes = 1;
+            break;
+        case OP_SET_LOCAL:
+            valid = code[1] < height && (code[1] > 0 || !script);
+            pops = pushes = 1;
+            break;
+        case OP_GET_UPVALUE:
+            valid = code[1] < function->upvalueCount;
+            pushes = 1;
+            break;
+        case OP_SET_UPVALUE:
+            valid = code[1] < function->upvalueCount;
+            pops = pushes = 1;
+            break;
+        case OP_GET_GLOBAL:
+            valid = verifyName(vm, chunk, code[1]);
+            pushes = 1;
+            break;
+        case OP_DEFINE_GLOBAL:
+            valid = verifyName(vm, chunk, code[1]);
+            pops = 1;
+            break;
+        case OP_SET_GLOBAL:
+            valid = verifyName(vm, chunk, code[1]);
+            pops = pushes = 1;
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            pops = pushes = 1;
+            break;
+        case OP_JUMP:
+            target = offset + 3 + (code[1] << 8 | code[2]);
+            fallsThrough = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+            target = offset + 3 + (code[1] << 8 | code[2]);
+            pops = pushes = 1;
+            break;
+        case OP_LOOP:
+            target = offset + 3 - (code[1] << 8 | code[2]);
+            fallsThrough = false;
+            break;
+        case OP_CALL:
+            pops = code[1] + 1;
+            pushes = 1;
+            break;
+        case OP_CLOSURE:
+        {
+            int upvalueCount = (length - 2) / 2;
+            for (int i = 0; i < upvalueCount && valid; i++)
+            {
+                uint8_t isLocal = code[2 + 2 * i];
+                uint8_t index = code[3 + 2 * i];
+                valid = isLocal ? isLocal == 1 && index < height && (index > 0 || !script)
+                                : index < function->upvalueCount;
+            }
+            pushes = 1;
+            break;
+        }
+        case OP_RETURN:
+            pops = 1;
+            fallsThrough = false;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+
+        height += pushes - pops;
+        // nothing pops slot 0, the callee, and the script can't read its own.
+        // calling it again would report a function with no name
+        if (!valid || height - pushes < 1 || height > UINT8_COUNT)
+        {
+            valid = false;
+            break;
+        }
+        if (height > maxHeight)
+            maxHeight = height;
+
+        int next[2];
+        int nextCount = 0;
+        if (fallsThrough)
+            next[nextCount++] = offset + length;
+        if (target != -1)
+            next[nextCount++] = target;
+        for (int i = 0; i < nextCount && valid; i++)
+        {
+            if (next[i] < 0 || next[i] >= count || heights[next[i]] == -2)
+                valid = false;
+            else if (heights[next[i]] == -1)
+            {
+                heights[next[i]] = height;
+                pending[pendingCount++] = next[i];
+            }
+            else
+                valid = heights[next[i]] == height;
+        }
+    }
+
+    FREE_ARRAY(int, heights, count);
+    FREE_ARRAY(int, pending, count);
+    function->stackSize = maxHeight;
+    return valid;
+}
+
+ObjFunction *loadCache(VM *vm, const char *path, uint64_t sourceHash, size_t sourceLength, CacheImage *image)
+{
+    image->region = NULL;
+    image->size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // private and writable, verifying rewrites opcodes in the process's copy
+    void *region = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return NULL;
+
+    image->region = region;
+    image->size = (size_t)st.st_size;
+
+    const CacheHeader *header = region;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->sourceHash != sourceHash ||
+        header->sourceLength != sourceLength ||
+        header->functionCount == 0)
+    {
+        closeCache(image);
+        return NULL;
+    }
+
+    CacheReader reader;
+    reader.current = (const uint8_t *)region + sizeof(CacheHeader);
+    reader.end = (const uint8_t *)region + image->size;
+    reader.vm = vm;
+    reader.failed = false;
+
+    int count = (int)header->functionCount;
+    ObjFunction **functions = ALLOCATE(ObjFunction *, count);
+    ObjFunction *script = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        functions[i] = readFunction(&reader, functions, i);
+        if (functions[i] == NULL)
+            break;
+        if (!verifyFunction(vm, functions[i], i == count - 1))
+        {
+            reader.failed = true;
+            break;
+        }
+        inferNumericTypes(functions[i]);
+        script = functions[i];
+    }
+    FREE_ARRAY(ObjFunction *, functions, count);
+
+    if (reader.failed)
+    {
+        closeCache(image);
+        return NULL;
+    }
+    return script;
+}
+
+void closeCache(CacheImage *image)
+{
+    if (image->region != NULL)
+        munmap(image->region, image->size);
+    image->region = NULL;
+    image->size = 0;
+}
@@ -16,8 +16,11 @@ void initChunk(Chunk *chunk)
 
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    // code and lines loaded from a bytecode cache have no capacity and belong to the mapping
+    if (chunk->capacity > 0)
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->lineCapacity > 0)
+        FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -4,18 +4,26 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "number.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// everything one compilation needs, so compiles for different vms never
+// share any state
 typedef struct
 {
+    Scanner scanner;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    struct Compiler *compiler; // the innermost function being compiled
+    bool lazy;
+    VM *vm;
 } Parser;
 
 typedef enum
@@ -26,6 +34,10 @@ typedef enum
     PREC_AND,
     PREC_EQUALITY,
     PREC_COMPARISON,
+    PREC_BIT_OR,
+    PREC_BIT_XOR,
+    PREC_BIT_AND,
+    PREC_SHIFT,
     PREC_TERM,
     PREC_FACTOR,
     PREC_UNARY,
@@ -33,7 +45,7 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct
 {
@@ -73,24 +85,22 @@ typedef struct Compiler
     int scopeDepth;
 } Compiler;
 
-Parser parser;
-Compiler *current = NULL;
-
-static Chunk *currentChunk()
+static Chunk *currentChunk(Parser *parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
-    if (parser.panicMode)
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    parser->panicMode = true;
+    fflush(parser->vm->out);
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
     {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     }
     else if (token->type == TOKEN_ERROR)
     {
@@ -98,204 +108,667 @@ static void errorAt(Token *token, const char *message)
     }
     else
     {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->err, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance()
+static void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        advance();
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart)
+static void emitLoop(Parser *parser, int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large");
+        error(parser, "Loop body too large");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser *parser, uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn()
+static void emitReturn(Parser *parser)
 {
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_NIL);
+    emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser *parser, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(currentChunk(parser), value);
     if (constant > UINT8_MAX)
     {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t)constant;
 }
 
-static void emitConstant(Value value)
+static void emitConstant(Parser *parser, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void patchJump(int offset)
+static void patchJump(Parser *parser, int offset)
 {
     //-2 for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX)
     {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler *comp, FunctionType type)
+static void initCompiler(Parser *parser, Compiler *comp, FunctionType type, ObjFunction *function)
 {
-    comp->enclosing = current;
+    comp->enclosing = parser->compiler;
     comp->function = NULL;
     comp->type = type;
     comp->localCount = 0;
     comp->scopeDepth = 0;
-    comp->function = newFunction();
-    current = comp;
+    comp->function = function != NULL ? function : newFunction(parser->vm);
+    parser->compiler = comp;
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && function == NULL)
     {
-        current->function->name = copyString(parser.previous.start,
-                                             parser.previous.length);
+        parser->compiler->function->name = copyString(parser->vm, parser->previous.start,
+                                                      parser->previous.length);
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
     local->name.start = "";
     local->name.length = 0;
 }
 
-static ObjFunction *endCompiler()
+typedef enum
+{
+    STATIC_ANY,
+    STATIC_NUMBER,  // a double
+    STATIC_INT,
+    STATIC_NUMERIC, // an integer or a double
+} StaticType;
+
+// deepest operand stack a function can have and still be analysed
+#define INFER_DEPTH_MAX (UINT8_COUNT * 2)
+
+typedef struct
+{
+    int depth; // -1 until the block has been reached
+    uint8_t types[INFER_DEPTH_MAX];
+} TypeState;
+
+typedef struct
+{
+    Chunk *chunk;
+    int *leaders; // index into states for jump targets, -1 otherwise
+    TypeState *states;
+    int *worklist;
+    bool *queued;
+    int worklistCount;
+    bool captured[UINT8_COUNT];
+    int maxDepth; // deepest any reachable instruction leaves the stack
+    bool failed;
+} TypeInference;
+
+static int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_POPN:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CONSTANT:
+    case OP_CALL:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        return 3;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(
+            chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    default:
+        return 1;
+    }
+}
+
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump
+                                          : offset + 3 + jump;
+}
+
+static StaticType joinTypes(StaticType a, StaticType b)
+{
+    if (a == b)
+        return a;
+    if (a == STATIC_ANY || b == STATIC_ANY)
+        return STATIC_ANY;
+    return STATIC_NUMERIC;
+}
+
+static void mergeState(TypeInference *inference, int target, TypeState *state)
 {
-    emitReturn();
-    ObjFunction *function = current->function;
+    int leader = inference->leaders[target];
+    TypeState *into = &inference->states[leader];
+    bool changed = false;
+
+    if (into->depth == -1)
+    {
+        into->depth = state->depth;
+        memcpy(into->types, state->types, state->depth);
+        changed = true;
+    }
+    else if (into->depth != state->depth)
+    {
+        inference->failed = true;
+        return;
+    }
+    else
+    {
+        for (int i = 0; i < state->depth; i++)
+        {
+            StaticType joined = joinTypes(into->types[i], state->types[i]);
+            if (joined != into->types[i])
+            {
+                into->types[i] = joined;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed && !inference->queued[leader])
+    {
+        inference->queued[leader] = true;
+        inference->worklist[inference->worklistCount++] = target;
+    }
+}
+
+static void pushType(TypeInference *inference, TypeState *state, StaticType type)
+{
+    if (state->depth == INFER_DEPTH_MAX)
+    {
+        inference->failed = true;
+        return;
+    }
+    state->types[state->depth++] = type;
+    if (state->depth > inference->maxDepth)
+        inference->maxDepth = state->depth;
+}
+
+static StaticType popType(TypeInference *inference, TypeState *state)
+{
+    if (state->depth == 0)
+    {
+        inference->failed = true;
+        return STATIC_ANY;
+    }
+    return state->types[--state->depth];
+}
+
+// abstractly executes one instruction, returns false when control does not fall through
+static bool inferInstruction(TypeInference *inference, int offset, TypeState *state, bool rewrite)
+{
+    uint8_t *code = &inference->chunk->code[offset];
+
+    switch (*code)
+    {
+    case OP_CONSTANT:
+    {
+        Value constant = inference->chunk->constants.values[code[1]];
+        pushType(inference, state, IS_NUMBER(constant) ? STATIC_NUMBER : IS_INT(constant) ? STATIC_INT
+                                                                                          : STATIC_ANY);
+        break;
+    }
+    case OP_GET_LOCAL:
+    {
+        uint8_t slot = code[1];
+        if (slot >= state->depth)
+        {
+            inference->failed = true;
+            break;
+        }
+        pushType(inference, state, inference->captured[slot] ? STATIC_ANY : state->types[slot]);
+        break;
+    }
+    case OP_SET_LOCAL:
+    {
+        uint8_t slot = code[1];
+        if (slot >= state->depth || state->depth == 0)
+        {
+            inference->failed = true;
+            break;
+        }
+        state->types[slot] = state->types[state->depth - 1];
+        break;
+    }
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_UPVALUE:
+    case OP_GET_GLOBAL:
+    case OP_CLOSURE:
+    {
+        pushType(inference, state, STATIC_ANY);
+        break;
+    }
+    case OP_POP:
+    case OP_PRINT:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    {
+        popType(inference, state);
+        break;
+    }
+    case OP_POPN:
+    {
+        for (int n = code[1]; n > 0; n--)
+            popType(inference, state);
+        break;
+    }
+    case OP_SET_UPVALUE:
+    case OP_SET_GLOBAL:
+        break;
+    case OP_EQUAL:
+    case OP_NOT:
+    {
+        if (*code == OP_EQUAL)
+            popType(inference, state);
+        popType(inference, state);
+        pushType(inference, state, STATIC_ANY);
+        break;
+    }
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    {
+        StaticType operand = popType(inference, state);
+        if (rewrite && operand == STATIC_NUMBER)
+            *code = OP_NEGATE_NUM;
+        // a checked negate only completes on a number, of the same kind
+        // except for the smallest integer, whose negation is a double
+        pushType(inference, state, operand == STATIC_NUMBER ? STATIC_NUMBER : STATIC_NUMERIC);
+        break;
+    }
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_INT:
+    case OP_LESS_INT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_MULTIPLY_INT:
+    {
+        StaticType b = popType(inference, state);
+        StaticType a = popType(inference, state);
+        bool numeric = a != STATIC_ANY && b != STATIC_ANY;
+        // a double on either side makes the result a double, two integers
+        // give an integer or, when it overflows, a double
+        bool floating = a == STATIC_NUMBER || b == STATIC_NUMBER;
+        bool integral = a == STATIC_INT && b == STATIC_INT;
+        StaticType result = floating ? STATIC_NUMBER : STATIC_NUMERIC;
+        OpCode floatCode = OP_RETURN;
+        OpCode intCode = OP_RETURN;
+
+        switch (*code)
+        {
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_GREATER_INT:
+            floatCode = OP_GREATER_NUM;
+            intCode = OP_GREATER_INT;
+            result = STATIC_ANY;
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_LESS_INT:
+            floatCode = OP_LESS_NUM;
+            intCode = OP_LESS_INT;
+            result = STATIC_ANY;
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_INT:
+            floatCode = OP_ADD_NUM;
+            intCode = OP_ADD_INT;
+            // strings concatenate too, unless a side is known to be a number
+            if (a == STATIC_ANY && b == STATIC_ANY)
+                result = STATIC_ANY;
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_SUBTRACT_INT:
+            floatCode = OP_SUBTRACT_NUM;
+            intCode = OP_SUBTRACT_INT;
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_MULTIPLY_INT:
+            floatCode = OP_MULTIPLY_NUM;
+            intCode = OP_MULTIPLY_INT;
+            break;
+        case OP_MODULO:
+            // the one integer operation that can't overflow
+            if (integral)
+                result = STATIC_INT;
+            break;
+        default:
+            // division always produces a double
+            floatCode = OP_DIVIDE_NUM;
+            floating = true;
+            result = STATIC_NUMBER;
+            break;
+        }
+
+        if (rewrite && numeric && floating && floatCode != OP_RETURN)
+            *code = floatCode;
+        else if (rewrite && integral && intCode != OP_RETURN)
+            *code = intCode;
+        pushType(inference, state, result);
+        break;
+    }
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    {
+        // only completes on two integers
+        popType(inference, state);
+        popType(inference, state);
+        pushType(inference, state, STATIC_INT);
+        break;
+    }
+    case OP_CALL:
+    {
+        for (int n = code[1] + 1; n > 0; n--)
+            popType(inference, state);
+        pushType(inference, state, STATIC_ANY);
+        break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+    {
+        if (!rewrite)
+            mergeState(inference, jumpTarget(inference->chunk, offset), state);
+        return false;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        if (!rewrite)
+            mergeState(inference, jumpTarget(inference->chunk, offset), state);
+        break;
+    }
+    case OP_RETURN:
+        return false;
+    default:
+        inference->failed = true;
+        return false;
+    }
+    return true;
+}
+
+// runs the basic block starting at a jump target, feeding successors
+static void inferBlock(TypeInference *inference, int start, bool rewrite)
+{
+    Chunk *chunk = inference->chunk;
+    TypeState state = inference->states[inference->leaders[start]];
+
+    int offset = start;
+    for (;;)
+    {
+        bool fallsThrough = inferInstruction(inference, offset, &state, rewrite);
+        if (inference->failed || !fallsThrough)
+            return;
+
+        offset += instructionLength(chunk, offset);
+        if (offset >= chunk->count)
+            return;
+        if (inference->leaders[offset] != -1)
+        {
+            if (!rewrite)
+                mergeState(inference, offset, &state);
+            return;
+        }
+    }
+}
+
+// flow-sensitive inference over the operand stack, locals included, of a
+// finished function. arithmetic whose operands are proven numbers is
+// rewritten in place to the unchecked opcodes, and the deepest the stack
+// gets is the function's stack size
+void inferNumericTypes(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0 || function->arity + 1 > INFER_DEPTH_MAX)
+        return;
+
+    TypeInference inference;
+    inference.chunk = chunk;
+    inference.failed = false;
+    inference.maxDepth = function->arity + 1;
+    inference.worklistCount = 0;
+    memset(inference.captured, 0, sizeof(inference.captured));
+    inference.leaders = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        inference.leaders[i] = -1;
+    }
+
+    // slots captured by closures can change behind any call, never trust them
+    int leaderCount = 0;
+    inference.leaders[0] = leaderCount++;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+        {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target >= chunk->count)
+            {
+                FREE_ARRAY(int, inference.leaders, chunk->count);
+                return;
+            }
+            if (inference.leaders[target] == -1)
+                inference.leaders[target] = leaderCount++;
+        }
+        else if (instruction == OP_CLOSURE)
+        {
+            for (int i = offset + 2; i < offset + instructionLength(chunk, offset); i += 2)
+            {
+                if (chunk->code[i])
+                    inference.captured[chunk->code[i + 1]] = true;
+            }
+        }
+    }
+
+    inference.states = ALLOCATE(TypeState, leaderCount);
+    inference.worklist = ALLOCATE(int, leaderCount);
+    inference.queued = ALLOCATE(bool, leaderCount);
+    for (int i = 0; i < leaderCount; i++)
+    {
+        inference.states[i].depth = -1;
+        inference.queued[i] = false;
+    }
+
+    TypeState entry;
+    entry.depth = function->arity + 1;
+    memset(entry.types, STATIC_ANY, entry.depth);
+    mergeState(&inference, 0, &entry);
+
+    while (inference.worklistCount > 0 && !inference.failed)
+    {
+        int start = inference.worklist[--inference.worklistCount];
+        inference.queued[inference.leaders[start]] = false;
+        inferBlock(&inference, start, false);
+    }
+
+    if (!inference.failed)
+    {
+        function->stackSize = inference.maxDepth;
+        for (int offset = 0; offset < chunk->count; offset++)
+        {
+            int leader = inference.leaders[offset];
+            if (leader != -1 && inference.states[leader].depth != -1)
+                inferBlock(&inference, offset, true);
+        }
+    }
+
+    FREE_ARRAY(bool, inference.queued, leaderCount);
+    FREE_ARRAY(int, inference.worklist, leaderCount);
+    FREE_ARRAY(TypeState, inference.states, leaderCount);
+    FREE_ARRAY(int, inference.leaders, chunk->count);
+}
+
+static ObjFunction *endCompiler(Parser *parser)
+{
+    emitReturn(parser);
+    ObjFunction *function = parser->compiler->function;
+
+    if (!parser->hadError)
+    {
+        inferNumericTypes(function);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!parser->hadError)
     {
-        disassembleChunk(currentChunk(), function->name != NULL
-                                             ? function->name->chars
-                                             : "<script>");
+        disassembleChunk(currentChunk(parser), function->name != NULL
+                                                   ? function->name->chars
+                                                   : "<script>");
     }
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void beginScope()
+static void beginScope(Parser *parser)
 {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser *parser)
 {
-    current->scopeDepth--;
+    parser->compiler->scopeDepth--;
 
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth >
-               current->scopeDepth)
+    while (parser->compiler->localCount > 0 &&
+           parser->compiler->locals[parser->compiler->localCount - 1].depth >
+               parser->compiler->scopeDepth)
     {
-        bool isCaptured = current->locals[current->localCount - 1].isCaptured;
+        bool isCaptured = parser->compiler->locals[parser->compiler->localCount - 1].isCaptured;
         if (isCaptured)
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitByte(parser, OP_CLOSE_UPVALUE);
         }
         else
         {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precendece);
+static void parsePrecedence(Parser *parser, Precedence precendece);
 
-static uint8_t identifierConstant(Token *name)
+static uint8_t identifierConstant(Parser *parser, Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start,
-                                           name->length)));
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start,
+                                                   name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -305,7 +778,7 @@ static bool identifiersEqual(Token *a, Token *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--)
     {
@@ -314,7 +787,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
         {
             if (local->depth == -1)
             {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -322,13 +795,13 @@ static int resolveLocal(Compiler *compiler, Token *name)
     return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
     if (upvalueCount == UINT8_COUNT)
     {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -346,177 +819,223 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler *compiler, Token *name)
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name)
 {
     if (compiler->enclosing == NULL)
+    {
+        // a lazily compiled body resolves against the names recorded when it was skipped
+        ObjFunction *function = compiler->function;
+        if (function->upvalueNames == NULL)
+            return -1;
+
+        for (int i = 0; i < function->upvalueCount; i++)
+        {
+            ObjString *upvalueName = function->upvalueNames[i];
+            if (upvalueName->length == name->length &&
+                memcmp(upvalueName->chars, name->start, name->length) == 0)
+            {
+                return i;
+            }
+        }
         return -1;
+    }
 
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1)
     {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
     return -1;
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser *parser, Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (parser->compiler->localCount == UINT8_COUNT)
     {
-        error("Too many local variables defined.");
+        error(parser, "Too many local variables defined.");
         return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
 }
 
-static void declareVariable()
+static void declareVariable(Parser *parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return;
 
-    Token *name = &parser.previous;
+    Token *name = &parser->previous;
 
-    for (int i = current->localCount - 1; i >= 0; i--)
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
         {
             break;
         }
 
         if (identifiersEqual(name, &local->name))
         {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char *errorMessage)
+static uint8_t parseVariable(Parser *parser, const char *errorMessage)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0)
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
         return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser *parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser *parser, uint8_t global)
 {
-    if (current->scopeDepth > 0)
+    if (parser->compiler->scopeDepth > 0)
     {
-        markInitialized();
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList()
+static uint8_t argumentList(Parser *parser)
 {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN))
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            expression();
+            expression(parser);
             argCount++;
             if (argCount == 255)
             {
-                error("Function arguments count can not exceed 255.");
+                error(parser, "Function arguments count can not exceed 255.");
             }
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
     return argCount;
 }
 
-static void and_(__attribute__((unused)) bool canAssign)
+static void and_(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
-static void binary(__attribute__((unused)) bool canAssign)
+static void binary(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
     switch (operatorType)
     {
     case TOKEN_BANG_EQUAL:
     {
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitBytes(parser, OP_EQUAL, OP_NOT);
         break;
     }
     case TOKEN_EQUAL_EQUAL:
     {
-        emitByte(OP_EQUAL);
+        emitByte(parser, OP_EQUAL);
         break;
     }
     case TOKEN_GREATER:
     {
-        emitByte(OP_GREATER);
+        emitByte(parser, OP_GREATER);
         break;
     }
     case TOKEN_GREATER_EQUAL:
     {
-        emitBytes(OP_LESS, OP_NOT);
+        emitBytes(parser, OP_LESS, OP_NOT);
         break;
     }
     case TOKEN_LESS:
     {
-        emitByte(OP_LESS);
+        emitByte(parser, OP_LESS);
         break;
     }
     case TOKEN_LESS_EQUAL:
     {
-        emitBytes(OP_GREATER, OP_NOT);
+        emitBytes(parser, OP_GREATER, OP_NOT);
         break;
     }
     case TOKEN_PLUS:
     {
-        emitByte(OP_ADD);
+        emitByte(parser, OP_ADD);
         break;
     }
     case TOKEN_MINUS:
     {
-        emitByte(OP_SUBTRACT);
+        emitByte(parser, OP_SUBTRACT);
         break;
     }
     case TOKEN_STAR:
     {
-        emitByte(OP_MULTIPLY);
+        emitByte(parser, OP_MULTIPLY);
         break;
     }
     case TOKEN_SLASH:
     {
-        emitByte(OP_DIVIDE);
+        emitByte(parser, OP_DIVIDE);
+        break;
+    }
+    case TOKEN_PERCENT:
+    {
+        emitByte(parser, OP_MODULO);
+        break;
+    }
+    case TOKEN_AMPERSAND:
+    {
+        emitByte(parser, OP_BIT_AND);
+        break;
+    }
+    case TOKEN_PIPE:
+    {
+        emitByte(parser, OP_BIT_OR);
+        break;
+    }
+    case TOKEN_CARET:
+    {
+        emitByte(parser, OP_BIT_XOR);
+        break;
+    }
+    case TOKEN_LESS_LESS:
+    {
+        emitByte(parser, OP_SHIFT_LEFT);
+        break;
+    }
+    case TOKEN_GREATER_GREATER:
+    {
+        emitByte(parser, OP_SHIFT_RIGHT);
         break;
     }
     default:
@@ -524,29 +1043,29 @@ static void binary(__attribute__((unused)) bool canAssign)
     }
 }
 
-static void call(__attribute__((unused)) bool canAssign)
+static void call(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
 }
 
-static void literal(__attribute__((unused)) bool canAssign)
+static void literal(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_FALSE:
     {
-        emitByte(OP_FALSE);
+        emitByte(parser, OP_FALSE);
         break;
     }
     case TOKEN_NIL:
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
         break;
     }
     case TOKEN_TRUE:
     {
-        emitByte(OP_TRUE);
+        emitByte(parser, OP_TRUE);
         break;
     }
     default:
@@ -554,89 +1073,95 @@ static void literal(__attribute__((unused)) bool canAssign)
     }
 }
 
-static void grouping(__attribute__((unused)) bool canAssign)
+static void grouping(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(__attribute__((unused)) bool canAssign)
+static void number(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    int64_t integer;
+    if (parseInteger(parser->previous.start, parser->previous.length, &integer))
+    {
+        emitConstant(parser, INT_VAL(integer));
+        return;
+    }
+    double value = parseNumber(parser->previous.start, parser->previous.length);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(__attribute__((unused)) bool canAssign)
+static void or_(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
-static void string(__attribute__((unused)) bool canAssign)
+static void string(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1,
+                                            parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
     uint8_t getOP, setOP;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1)
     {
         getOP = OP_GET_LOCAL;
         setOP = OP_SET_LOCAL;
     }
-    else if ((arg = resolveUpvalue(current, &name)) != -1)
+    else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1)
     {
         getOP = OP_GET_UPVALUE;
         setOP = OP_SET_UPVALUE;
     }
     else
     {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(parser, &name);
         getOP = OP_GET_GLOBAL;
         setOP = OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(setOP, (uint64_t)arg);
+        expression(parser);
+        emitBytes(parser, setOP, (uint64_t)arg);
     }
     else
     {
-        emitBytes(getOP, (uint64_t)arg);
+        emitBytes(parser, getOP, (uint64_t)arg);
     }
 }
 
-static void variable(bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void unary(__attribute__((unused)) bool canAssign)
+static void unary(Parser *parser, __attribute__((unused)) bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     switch (operatorType)
     {
     case TOKEN_MINUS:
     {
-        emitByte(OP_NEGATE);
+        emitByte(parser, OP_NEGATE);
         break;
     }
     case TOKEN_BANG:
     {
-        emitByte(OP_NOT);
+        emitByte(parser, OP_NOT);
         break;
     }
 
@@ -657,6 +1182,10 @@ ParseRule rules[] = {
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_AMPERSAND] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
@@ -665,6 +1194,8 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
@@ -688,29 +1219,29 @@ ParseRule rules[] = {
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        error("Invalid assignment target.");
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -719,211 +1250,313 @@ static ParseRule *getRule(TokenType type)
     return &rules[type];
 }
 
-static void expression()
+static void expression(Parser *parser)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser *parser)
 {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static void functionBody(Parser *parser)
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function names.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
+            {
+                errorAtCurrent(parser, "Function parameter count can not exceed 255.");
+            }
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+}
+
+// records a variable a skipped body may refer to, any identifier that resolves
+// outside the body is captured. names the body declares itself are captured
+// needlessly, which costs an upvalue but never changes what the body sees
+static void captureLazyName(Parser *parser, Token *name, Upvalue *upvalues, ObjString **names, int *count)
+{
+    int index = resolveLocal(parser, parser->compiler, name);
+    bool isLocal = index != -1;
+    if (isLocal)
+    {
+        parser->compiler->locals[index].isCaptured = true;
+    }
+    else if ((index = resolveUpvalue(parser, parser->compiler, name)) == -1)
+    {
+        return;
+    }
+
+    for (int i = 0; i < *count; i++)
+    {
+        if (upvalues[i].index == index && upvalues[i].isLocal == isLocal)
+            return;
+    }
+
+    if (*count == UINT8_COUNT)
+    {
+        error(parser, "Too many closure variables in function.");
+        return;
+    }
+
+    upvalues[*count].isLocal = isLocal;
+    upvalues[*count].index = (uint8_t)index;
+    names[*count] = copyString(parser->vm, name->start, name->length);
+    (*count)++;
+}
+
+// skips a function body by matching braces, keeping only its source span,
+// arity and captured variables. the body is compiled by compileLazy() when
+// the function is first called
+static void lazyFunction(Parser *parser)
+{
+    ObjFunction *function = newFunction(parser->vm);
+    function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
+    function->lazySource = parser->current.start;
+    function->lazyLine = parser->current.line;
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function names.");
-    if (!check(TOKEN_RIGHT_PAREN))
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function names.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            current->function->arity++;
-            if (current->function->arity > 255)
+            function->arity++;
+            if (function->arity > 255)
             {
-                errorAtCurrent("Function parameter count can not exceed 255.");
+                errorAtCurrent(parser, "Function parameter count can not exceed 255.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    Upvalue upvalues[UINT8_COUNT];
+    ObjString *names[UINT8_COUNT];
+    int upvalueCount = 0;
+    for (int depth = 1; depth > 0;)
+    {
+        if (check(parser, TOKEN_EOF))
+        {
+            errorAtCurrent(parser, "Expect '}' after block.");
+            return;
+        }
+        advance(parser);
+        if (parser->previous.type == TOKEN_LEFT_BRACE)
+            depth++;
+        else if (parser->previous.type == TOKEN_RIGHT_BRACE)
+            depth--;
+        else if (parser->previous.type == TOKEN_IDENTIFIER)
+            captureLazyName(parser, &parser->previous, upvalues, names, &upvalueCount);
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
 
-    ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    function->upvalueCount = upvalueCount;
+    function->upvalueNames = ALLOCATE(ObjString *, upvalueCount);
+    memcpy(function->upvalueNames, names, sizeof(ObjString *) * upvalueCount);
+
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
+    for (int i = 0; i < upvalueCount; i++)
+    {
+        emitByte(parser, upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, upvalues[i].index);
+    }
+}
+
+static void function(Parser *parser, FunctionType type)
+{
+    if (parser->lazy)
+    {
+        lazyFunction(parser);
+        return;
+    }
+
+    Compiler compiler;
+    initCompiler(parser, &compiler, type, NULL);
+    functionBody(parser);
+
+    ObjFunction *function = endCompiler(parser);
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void funDeclaration()
+static void funDeclaration(Parser *parser)
 {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+    uint8_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration()
+static void varDeclaration(Parser *parser)
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint8_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL))
+    if (match(parser, TOKEN_EQUAL))
     {
-        expression();
+        expression(parser);
     }
     else
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement()
+static void forStatement(Parser *parser)
 {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON))
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON))
     {
         // no initializer
     }
-    else if (match(TOKEN_VAR))
+    else if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
     else
     {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON))
+    if (!match(parser, TOKEN_SEMICOLON))
     {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
     }
-    if (!match(TOKEN_RIGHT_PAREN))
+    if (!match(parser, TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1)
     {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
     }
 
-    endScope();
+    endScope(parser);
 }
 
-static void ifStatement()
+static void ifStatement(Parser *parser)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE))
-        statement();
+    if (match(parser, TOKEN_ELSE))
+        statement(parser);
 
-    patchJump(elseJump);
+    patchJump(parser, elseJump);
 }
 
-static void printStatement()
+static void printStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value to print.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value to print.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement()
+static void returnStatement(Parser *parser)
 {
-    if (current->type == TYPE_SCRIPT)
+    if (parser->compiler->type == TYPE_SCRIPT)
     {
-        error("Cannot return from top-level code.");
+        error(parser, "Cannot return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
     {
-        emitReturn();
+        emitReturn(parser);
     }
     else
     {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value");
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement()
+static void whileStatement(Parser *parser)
 {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_FOR)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -936,77 +1569,103 @@ static void synchronize()
             return;
         default:; // do nothing
         }
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-    if (match(TOKEN_VAR))
+    if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
-    else if (match(TOKEN_FUN))
+    else if (match(parser, TOKEN_FUN))
     {
-        funDeclaration();
+        funDeclaration(parser);
     }
     else
     {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
-static void statement()
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT))
+    if (match(parser, TOKEN_PRINT))
     {
-        printStatement();
+        printStatement(parser);
     }
-    else if (match(TOKEN_IF))
+    else if (match(parser, TOKEN_IF))
     {
-        ifStatement();
+        ifStatement(parser);
     }
-    else if (match(TOKEN_RETURN))
+    else if (match(parser, TOKEN_RETURN))
     {
-        returnStatement();
+        returnStatement(parser);
     }
-    else if (match(TOKEN_WHILE))
+    else if (match(parser, TOKEN_WHILE))
     {
-        whileStatement();
+        whileStatement(parser);
     }
-    else if (match(TOKEN_FOR))
+    else if (match(parser, TOKEN_FOR))
     {
-        forStatement();
+        forStatement(parser);
     }
-    else if (match(TOKEN_LEFT_BRACE))
+    else if (match(parser, TOKEN_LEFT_BRACE))
     {
-        beginScope();
-        block();
-        endScope();
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
     else
     {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-ObjFunction *compile(const char *source)
+static void initParser(Parser *parser, VM *vm, const char *source, int line, bool lazy)
 {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initScanner(&parser->scanner, source, line);
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->compiler = NULL;
+    parser->lazy = lazy;
+    parser->vm = vm;
+}
 
-    parser.hadError = false;
-    parser.panicMode = false;
+ObjFunction *compile(VM *vm, const char *source, bool lazy)
+{
+    Parser context;
+    Parser *parser = &context;
+    initParser(parser, vm, source, 1, lazy);
+    Compiler compiler;
+    initCompiler(parser, &compiler, TYPE_SCRIPT, NULL);
 
-    advance();
-    while (!match(TOKEN_EOF))
+    advance(parser);
+    while (!match(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     };
-    ObjFunction *function = endCompiler();
-    return parser.hadError ? NULL : function;
+    ObjFunction *function = endCompiler(parser);
+    return parser->hadError ? NULL : function;
+}
+
+bool compileLazy(VM *vm, ObjFunction *function)
+{
+    Parser context;
+    Parser *parser = &context;
+    initParser(parser, vm, function->lazySource, function->lazyLine, true);
+    Compiler compiler;
+    initCompiler(parser, &compiler, TYPE_FUNCTION, function);
+
+    advance(parser);
+    function->arity = 0;
+    functionBody(parser);
+    endCompiler(parser);
+
+    function->lazySource = NULL;
+    return !parser->hadError;
 }
@@ -12,7 +12,7 @@ static void printConstants(Chunk *chunk)
     {
         Value v = chunk->constants.values[i];
         printf("[ ");
-        printValue(v);
+        printValue(stdout, v);
         printf(" ]");
         if (IS_STRING(v))
         {
@@ -69,7 +69,7 @@ static int constantInstruction(const char *name, Chunk *chunk,
 {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(stdout, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 2;
 }
@@ -102,6 +102,18 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
         return simpleInstruction("OP_DIVIDE", offset);
+    case OP_MODULO:
+        return simpleInstruction("OP_MODULO", offset);
+    case OP_BIT_AND:
+        return simpleInstruction("OP_BIT_AND", offset);
+    case OP_BIT_OR:
+        return simpleInstruction("OP_BIT_OR", offset);
+    case OP_BIT_XOR:
+        return simpleInstruction("OP_BIT_XOR", offset);
+    case OP_SHIFT_LEFT:
+        return simpleInstruction("OP_SHIFT_LEFT", offset);
+    case OP_SHIFT_RIGHT:
+        return simpleInstruction("OP_SHIFT_RIGHT", offset);
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
     case OP_NIL:
@@ -148,12 +160,36 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_NEGATE_NUM:
+        return simpleInstruction("OP_NEGATE_NUM", offset);
+    case OP_GREATER_INT:
+        return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_LESS_INT:
+        return simpleInstruction("OP_LESS_INT", offset);
+    case OP_ADD_INT:
+        return simpleInstruction("OP_ADD_INT", offset);
+    case OP_SUBTRACT_INT:
+        return simpleInstruction("OP_SUBTRACT_INT", offset);
+    case OP_MULTIPLY_INT:
+        return simpleInstruction("OP_MULTIPLY_INT", offset);
     case OP_CLOSURE:
     {
         offset++;
         uint8_t constant = chunk->code[offset++];
         printf("%-16s %4d", "OP_CLOSURE", constant);
-        printValue(chunk->constants.values[constant]);
+        printValue(stdout, chunk->constants.values[constant]);
         printf("\n");
 
         ObjFunction *function = AS_FUNCTION(
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "hash.h"
+
+// string hashes are keyed with a per-process random seed, so a script fed
+// untrusted input cannot precompute keys that collide in vm.strings or a
+// table. wyhash by default, SipHash-1-3 with HASH_SIPHASH
+static uint64_t seed[2];
+static pthread_once_t seeded = PTHREAD_ONCE_INIT;
+
+static void generateSeed()
+{
+    if (getrandom(seed, sizeof(seed), 0) == sizeof(seed))
+        return;
+
+    // no entropy source, settle for something that still differs per run
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed[0] = (uint64_t)now.tv_nsec * 0x9e3779b97f4a7c15u ^ (uint64_t)now.tv_sec;
+    seed[1] = (uint64_t)getpid() * 0xc2b2ae3d27d4eb4fu ^ (uint64_t)(uintptr_t)&now;
+}
+
+// vms on different threads may all be starting up at once
+void seedHash()
+{
+    pthread_once(&seeded, generateSeed);
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#ifdef HASH_SIPHASH
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND            \
+    do                      \
+    {                       \
+        v0 += v1;           \
+        v1 = ROTL(v1, 13);  \
+        v1 ^= v0;           \
+        v0 = ROTL(v0, 32);  \
+        v2 += v3;           \
+        v3 = ROTL(v3, 16);  \
+        v3 ^= v2;           \
+        v0 += v3;           \
+        v3 = ROTL(v3, 21);  \
+        v3 ^= v0;           \
+        v2 += v1;           \
+        v1 = ROTL(v1, 17);  \
+        v1 ^= v2;           \
+        v2 = ROTL(v2, 32);  \
+    } while (false)
+
+uint32_t hashString(const char *key, int length)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    const uint8_t *end = p + (length & ~7);
+
+    uint64_t v0 = 0x736f6d6570736575u ^ seed[0];
+    uint64_t v1 = 0x646f72616e646f6du ^ seed[1];
+    uint64_t v2 = 0x6c7967656e657261u ^ seed[0];
+    uint64_t v3 = 0x7465646279746573u ^ seed[1];
+
+    for (; p != end; p += 8)
+    {
+        uint64_t m = read64(p);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t)length << 56;
+    switch (length & 7)
+    {
+    case 7:
+        last |= (uint64_t)p[6] << 48;
+        // fall through
+    case 6:
+        last |= (uint64_t)p[5] << 40;
+        // fall through
+    case 5:
+        last |= (uint64_t)p[4] << 32;
+        // fall through
+    case 4:
+        last |= (uint64_t)p[3] << 24;
+        // fall through
+    case 3:
+        last |= (uint64_t)p[2] << 16;
+        // fall through
+    case 2:
+        last |= (uint64_t)p[1] << 8;
+        // fall through
+    case 1:
+        last |= (uint64_t)p[0];
+    }
+
+    v3 ^= last;
+    SIPROUND;
+    v0 ^= last;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    uint64_t hash = v0 ^ v1 ^ v2 ^ v3;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#else
+
+static const uint64_t secret[4] = {
+    0xa0761d6478bd642fu, 0xe7037ed1a0b428dbu,
+    0x8ebc6af09c88c6e3u, 0x589965cc75374cc3u};
+
+// 64x64 multiply folded back to 64 bits
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint32_t hashString(const char *key, int length)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    size_t remaining = (size_t)length;
+    uint64_t state = seed[0] ^ mix(seed[1] ^ secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (remaining <= 16)
+    {
+        if (remaining >= 4)
+        {
+            // two overlapping reads cover 4 to 16 bytes without a loop
+            size_t quarter = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + quarter);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - quarter);
+        }
+        else if (remaining > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        if (remaining > 48)
+        {
+            // three independent lanes keep the multipliers busy on long strings
+            uint64_t lane1 = state, lane2 = state;
+            do
+            {
+                state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+                lane1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ lane1);
+                lane2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            state ^= lane1 ^ lane2;
+        }
+        while (remaining > 16)
+        {
+            state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+            p += 16;
+            remaining -= 16;
+        }
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= secret[1];
+    b ^= state;
+    __uint128_t product = (__uint128_t)a * b;
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+
+    uint64_t hash = mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#endif
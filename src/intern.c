@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+
+#define INTERN_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+// slots sharing a 64 byte cache line
+#define SLOTS_PER_LINE (64 / (int)sizeof(InternSlot))
+
+void initInternSet(InternSet *set)
+{
+    set->count = 0;
+    set->capacity = 0;
+    set->slots = NULL;
+}
+
+void freeInternSet(InternSet *set)
+{
+    FREE_ARRAY(InternSlot, set->slots, set->capacity);
+    initInternSet(set);
+}
+
+ObjString *internSetFind(InternSet *set, const char *chars, int length, uint32_t hash)
+{
+    if (set->count == 0)
+        return NULL;
+
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask)
+    {
+        // long runs spill into the next line, fetch it while this one is scanned
+        if (index % SLOTS_PER_LINE == 0)
+            __builtin_prefetch(&set->slots[(index + SLOTS_PER_LINE) & mask]);
+
+        InternSlot *slot = &set->slots[index];
+        if (slot->key == NULL)
+            return NULL;
+        if (slot->hash == hash && slot->length == length &&
+            memcmp(slot->key->chars, chars, length) == 0)
+        {
+            return slot->key;
+        }
+    }
+}
+
+static void insertSlot(InternSlot *slots, uint32_t mask, ObjString *string)
+{
+    uint32_t index = string->hash & mask;
+    while (slots[index].key != NULL)
+    {
+        index = (index + 1) & mask;
+    }
+    slots[index].key = string;
+    slots[index].hash = string->hash;
+    slots[index].length = string->length;
+}
+
+static void adjustCapacity(InternSet *set, int capacity)
+{
+    InternSlot *slots = ALLOCATE(InternSlot, capacity);
+    memset(slots, 0, sizeof(InternSlot) * capacity);
+
+    for (int i = 0; i < set->capacity; i++)
+    {
+        if (set->slots[i].key != NULL)
+            insertSlot(slots, (uint32_t)capacity - 1, set->slots[i].key);
+    }
+
+    FREE_ARRAY(InternSlot, set->slots, set->capacity);
+    set->slots = slots;
+    set->capacity = capacity;
+}
+
+// the caller has already checked that no equal string is in the set
+void internSetAdd(InternSet *set, ObjString *string)
+{
+    if (set->count + 1 > INTERN_MAX_LOAD(set->capacity))
+    {
+        adjustCapacity(set, set->capacity < 16 ? 16 : set->capacity * 2);
+    }
+    insertSlot(set->slots, (uint32_t)set->capacity - 1, string);
+    set->count++;
+}
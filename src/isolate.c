@@ -0,0 +1,520 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "isolate.h"
+#include "memory.h"
+#include "vm.h"
+
+// a value on its way from one vm to another, holding nothing from either heap
+typedef struct
+{
+    Value value;      // nil, a boolean, a number or a small string
+    char *chars;      // any longer text, copied out of the sender's heap
+    int length;
+    Channel *channel; // a channel reference the message owns
+} Message;
+
+typedef struct
+{
+    _Atomic size_t sequence;
+    Message message;
+} ChannelSlot;
+
+// Vyukov's bounded queue, so any number of isolates send and receive without
+// a lock. a slot's sequence says whether it is waiting for a sender or a
+// receiver at the current position, and the two positions sit on separate
+// cache lines so senders and receivers don't contend for one
+struct Channel
+{
+    _Atomic int refCount;
+    size_t mask;
+    ChannelSlot *slots;
+    char sendLine[64];
+    _Atomic size_t sendPosition;
+    char receiveLine[64];
+    _Atomic size_t receivePosition;
+};
+
+struct Isolate
+{
+    pthread_t thread;
+    int argCount;
+    bool failed;
+    bool joined;
+    Message result;
+    VM vm; // seeded by the spawner, then only touched by the thread
+};
+
+static bool packMessage(Value value, Message *message)
+{
+    message->value = NIL_VAL;
+    message->chars = NULL;
+    message->length = 0;
+    message->channel = NULL;
+
+    if (!IS_OBJ(value))
+    {
+        message->value = value;
+        return true;
+    }
+    if (IS_CHANNEL(value))
+    {
+        message->channel = AS_CHANNEL(value);
+        atomic_fetch_add_explicit(&message->channel->refCount, 1, memory_order_relaxed);
+        return true;
+    }
+    if (!IS_TEXT(value))
+        return false;
+
+    message->length = textLength(value);
+    message->chars = ALLOCATE(char, message->length + 1);
+    memcpy(message->chars, textChars(&value), message->length);
+    return true;
+}
+
+// the message keeps what it holds, so it can be unpacked more than once
+static Value unpackMessage(VM *vm, Message *message)
+{
+    if (message->chars != NULL)
+        return copyText(vm, message->chars, message->length);
+
+    if (message->channel != NULL)
+    {
+        atomic_fetch_add_explicit(&message->channel->refCount, 1, memory_order_relaxed);
+        return OBJ_VAL(newChannel(vm, message->channel));
+    }
+    return message->value;
+}
+
+static void discardMessage(Message *message)
+{
+    if (message->chars != NULL)
+        FREE_ARRAY(char, message->chars, message->length + 1);
+    if (message->channel != NULL)
+        releaseChannel(message->channel);
+}
+
+Channel *createChannel(int capacity)
+{
+    // the sequence scheme needs at least two slots
+    size_t size = 2;
+    while (size < (size_t)capacity)
+        size *= 2;
+
+    Channel *channel = ALLOCATE(Channel, 1);
+    atomic_init(&channel->refCount, 1);
+    channel->mask = size - 1;
+    channel->slots = ALLOCATE(ChannelSlot, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        atomic_init(&channel->slots[i].sequence, i);
+    }
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    return channel;
+}
+
+static bool trySend(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    ChannelSlot *slot;
+    for (;;)
+    {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            return false; // full
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+
+    slot->message = *message;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    return true;
+}
+
+static bool tryReceive(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    ChannelSlot *slot;
+    for (;;)
+    {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            return false; // empty
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+
+    *message = slot->message;
+    atomic_store_explicit(&slot->sequence, position + channel->mask + 1, memory_order_release);
+    return true;
+}
+
+// waits for the other side of a channel: spins while it is likely to be
+// running on another core, then yields, then naps so a long wait costs no cpu
+static void backoff(int *attempts)
+{
+    int attempt = (*attempts)++;
+    if (attempt < 64)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else if (attempt < 128)
+    {
+        sched_yield();
+    }
+    else
+    {
+        struct timespec nap = {0, 100000};
+        nanosleep(&nap, NULL);
+    }
+}
+
+void releaseChannel(Channel *channel)
+{
+    if (atomic_fetch_sub_explicit(&channel->refCount, 1, memory_order_acq_rel) != 1)
+        return;
+
+    Message message;
+    while (tryReceive(channel, &message))
+    {
+        discardMessage(&message);
+    }
+    FREE_ARRAY(ChannelSlot, channel->slots, channel->mask + 1);
+    FREE(Channel, channel);
+}
+
+// blocks while the channel is full. false when the value can't leave its vm
+bool channelSend(Channel *channel, Value value)
+{
+    Message message;
+    if (!packMessage(value, &message))
+        return false;
+
+    int attempts = 0;
+    while (!trySend(channel, &message))
+    {
+        backoff(&attempts);
+    }
+    return true;
+}
+
+// blocks while the channel is empty
+Value channelReceive(VM *vm, Channel *channel)
+{
+    Message message;
+    int attempts = 0;
+    while (!tryReceive(channel, &message))
+    {
+        backoff(&attempts);
+    }
+
+    Value value = unpackMessage(vm, &message);
+    discardMessage(&message);
+    return value;
+}
+
+typedef struct
+{
+    Obj *original;
+    Obj *copy;
+} CopiedObject;
+
+// deep copies values from one vm's heap into another's, copying each object
+// once so shared and cyclic structure (a closure that captures itself) stays so
+typedef struct
+{
+    VM *from;
+    VM *to;
+    CopiedObject *copied; // open addressing map from original to copy
+    int count;
+    int capacity;
+} Copier;
+
+static uint32_t hashPointer(Obj *object)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)((bits * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+static CopiedObject *findCopied(CopiedObject *copied, int capacity, Obj *original)
+{
+    uint32_t index = hashPointer(original) & (capacity - 1);
+    while (copied[index].original != NULL && copied[index].original != original)
+        index = (index + 1) & (capacity - 1);
+    return &copied[index];
+}
+
+static void recordCopy(Copier *copier, Obj *original, Obj *copy)
+{
+    if ((copier->count + 1) * 2 > copier->capacity)
+    {
+        int capacity = copier->capacity == 0 ? 64 : copier->capacity * 2;
+        CopiedObject *copied = ALLOCATE(CopiedObject, capacity);
+        memset(copied, 0, sizeof(CopiedObject) * capacity);
+        for (int i = 0; i < copier->capacity; i++)
+        {
+            if (copier->copied[i].original != NULL)
+                *findCopied(copied, capacity, copier->copied[i].original) = copier->copied[i];
+        }
+        FREE_ARRAY(CopiedObject, copier->copied, copier->capacity);
+        copier->copied = copied;
+        copier->capacity = capacity;
+    }
+
+    CopiedObject *entry = findCopied(copier->copied, copier->capacity, original);
+    entry->original = original;
+    entry->copy = copy;
+    copier->count++;
+}
+
+static bool copyValue(Copier *copier, Value value, Value *copy);
+
+static Obj *copyObject(Copier *copier, Obj *original)
+{
+    // both vms run the same program
+    if (original->frozen)
+        return original;
+
+    if (copier->capacity > 0)
+    {
+        CopiedObject *entry = findCopied(copier->copied, copier->capacity, original);
+        if (entry->original != NULL)
+            return entry->copy;
+    }
+
+    VM *to = copier->to;
+    switch (original->type)
+    {
+    case OBJ_STRING:
+    {
+        // only interned strings get here, constants and global names
+        ObjString *string = (ObjString *)original;
+        return (Obj *)copyString(to, string->chars, string->length);
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)original;
+        // a skipped body points into source the other vm may outlive
+        if (function->lazySource != NULL && !compileLazy(copier->from, function))
+            return NULL;
+
+        ObjFunction *copy = newFunction(to);
+        recordCopy(copier, original, (Obj *)copy);
+        copy->arity = function->arity;
+        copy->upvalueCount = function->upvalueCount;
+        copy->stackSize = function->stackSize;
+        if (function->name != NULL)
+            copy->name = copyString(to, function->name->chars, function->name->length);
+
+        Chunk *from = &function->chunk;
+        Chunk *chunk = &copy->chunk;
+        chunk->code = ALLOCATE(uint8_t, from->count);
+        memcpy(chunk->code, from->code, from->count);
+        chunk->count = chunk->capacity = from->count;
+        chunk->lines = ALLOCATE(LineStart, from->lineCount);
+        memcpy(chunk->lines, from->lines, sizeof(LineStart) * from->lineCount);
+        chunk->lineCount = chunk->lineCapacity = from->lineCount;
+        for (int i = 0; i < from->constants.count; i++)
+        {
+            Value constant;
+            if (!copyValue(copier, from->constants.values[i], &constant))
+                return NULL;
+            writeValueArray(&chunk->constants, constant);
+        }
+        return (Obj *)copy;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)original;
+        ObjFunction *function = (ObjFunction *)copyObject(copier, (Obj *)closure->function);
+        if (function == NULL)
+            return NULL;
+
+        ObjClosure *copy = newClosure(to, function);
+        recordCopy(copier, original, (Obj *)copy);
+        for (int i = 0; i < closure->upvalueCount; i++)
+        {
+            copy->upvalues[i] = (ObjUpvalue *)copyObject(copier, (Obj *)closure->upvalues[i]);
+            if (copy->upvalues[i] == NULL)
+                return NULL;
+        }
+        return (Obj *)copy;
+    }
+    case OBJ_UPVALUE:
+    {
+        // open or closed, the copy gets the variable's current value
+        ObjUpvalue *upvalue = (ObjUpvalue *)original;
+        ObjUpvalue *copy = newUpvalue(to, NULL);
+        copy->location = &copy->closed;
+        recordCopy(copier, original, (Obj *)copy);
+        if (!copyValue(copier, *upvalue->location, &copy->closed))
+            return NULL;
+        return (Obj *)copy;
+    }
+    case OBJ_NATIVE:
+    {
+        ObjNative *native = (ObjNative *)original;
+        return (Obj *)newNative(to, native->function, native->name);
+    }
+    case OBJ_CHANNEL:
+    {
+        Channel *channel = ((ObjChannel *)original)->channel;
+        atomic_fetch_add_explicit(&channel->refCount, 1, memory_order_relaxed);
+        return (Obj *)newChannel(to, channel);
+    }
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+        break; // copied as text by copyValue()
+    case OBJ_ISOLATE:
+        break; // only the vm that spawned an isolate can join it
+    case OBJ_COROUTINE:
+        break; // its stacks may point anywhere into the vm
+    }
+    return NULL;
+}
+
+static bool copyValue(Copier *copier, Value value, Value *copy)
+{
+    if (!IS_OBJ(value))
+    {
+        *copy = value;
+        return true;
+    }
+
+    // runtime text isn't interned, so the copy needn't be either
+    if (IS_TEXT(value) && !(IS_STRING(value) && AS_STRING(value)->interned))
+    {
+        *copy = copyText(copier->to, textChars(&value), textLength(value));
+        return true;
+    }
+
+    Obj *object = copyObject(copier, AS_OBJ(value));
+    *copy = OBJ_VAL(object);
+    return object != NULL;
+}
+
+// globals that can't cross, isolate handles, are left out of the copy
+static void copyGlobals(Copier *copier)
+{
+    Table *globals = &copier->from->globals;
+    for (int i = 0; i < globals->capacity; i++)
+    {
+        Entry *entry = &globals->entries[i];
+        Value value;
+        if (entry->key == NULL || !copyValue(copier, entry->value, &value))
+            continue;
+        ObjString *key = copyString(copier->to, entry->key->chars, entry->key->length);
+        tableSet(&copier->to->globals, key, value);
+    }
+}
+
+static void *runIsolate(void *argument)
+{
+    Isolate *isolate = (Isolate *)argument;
+    Value result;
+    isolate->failed = interpretCall(&isolate->vm, isolate->argCount, &result) != INTERPRET_OK ||
+                      !packMessage(result, &isolate->result);
+
+    // the result is out of the vm, nothing else in it is needed
+    freeVM(&isolate->vm);
+    return NULL;
+}
+
+// runs closure(args...) on a thread of its own, in a vm seeded with copies
+// of the spawner's globals, the closure and the arguments. the spawner's
+// program, if it has one, is shared rather than copied. a metered host's
+// budget carries over, so spawning can't outrun it. NULL when one of them
+// can't be copied
+Isolate *spawnIsolate(VM *vm, ObjClosure *closure, int argCount, Value *args)
+{
+    Isolate *isolate = ALLOCATE(Isolate, 1);
+    initVM(&isolate->vm, vm->program);
+    isolate->vm.out = vm->out;
+    isolate->vm.err = vm->err;
+    isolate->vm.fuel = vm->isolateFuel;
+    isolate->vm.isolateFuel = vm->isolateFuel;
+
+    Copier copier = {vm, &isolate->vm, NULL, 0, 0};
+    copyGlobals(&copier);
+    Value value;
+    bool copied = copyValue(&copier, OBJ_VAL(closure), &value);
+    push(&isolate->vm, value);
+    for (int i = 0; i < argCount && copied; i++)
+    {
+        copied = copyValue(&copier, args[i], &value);
+        push(&isolate->vm, value);
+    }
+    FREE_ARRAY(CopiedObject, copier.copied, copier.capacity);
+
+    if (!copied)
+    {
+        freeVM(&isolate->vm);
+        FREE(Isolate, isolate);
+        return NULL;
+    }
+
+    isolate->argCount = argCount;
+    isolate->failed = false;
+    isolate->joined = false;
+    packMessage(NIL_VAL, &isolate->result);
+    if (pthread_create(&isolate->thread, NULL, runIsolate, isolate) != 0)
+    {
+        fprintf(vm->err, "Could not start an isolate thread.\n");
+        freeVM(&isolate->vm);
+        isolate->failed = true;
+        isolate->joined = true;
+    }
+    return isolate;
+}
+
+// waits for the isolate to finish and returns a copy of its result, nil when
+// it failed or returned something that can't leave its vm
+Value joinIsolate(VM *vm, Isolate *isolate)
+{
+    if (!isolate->joined)
+    {
+        pthread_join(isolate->thread, NULL);
+        isolate->joined = true;
+    }
+    return isolate->failed ? NIL_VAL : unpackMessage(vm, &isolate->result);
+}
+
+void freeIsolate(Isolate *isolate)
+{
+    if (!isolate->joined)
+        pthread_join(isolate->thread, NULL);
+    discardMessage(&isolate->result);
+    FREE(Isolate, isolate);
+}
@@ -1,90 +1,725 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "output.h"
+#include "program.h"
+#include "serve.h"
+#include "snapshot.h"
 #include "vm.h"
 
+typedef struct
+{
+    bool lazy;
+    const char *snapshotPath; // written after the script runs
+    const char *imagePath;    // restored before anything runs
+    int jobs;                 // threads running a batch of scripts, 0 for one script
+    const char *servePath;    // the socket a server listens on
+    int prefork;              // worker processes sharing stdin's lines
+    int64_t fuel;             // loop iterations and calls a script may make, 0 for no limit
+    int64_t slice;            // how many of them a batch script runs per turn, 0 for no time-slicing
+    bool asyncOutput;         // a thread writes out what the script prints
+} Options;
+
+static Options options;
+static VM vm;
+static SnapshotImage snapshot;
+
+static void startVM(Program *program)
+{
+    initVM(&vm, program);
+    if (options.imagePath != NULL && !loadSnapshot(&vm, options.imagePath, &snapshot))
+    {
+        fprintf(stderr, "Could not load snapshot \"%s\".\n", options.imagePath);
+        exit(74);
+    }
+}
+
 static void repl()
 {
     char line[1024];
     for (;;)
     {
-        printf("> ");
+        fputs("> ", vm.out);
+        fflush(vm.out);
 
         if (!fgets(line, sizeof(line), stdin))
         {
-            printf("\n");
+            fputc('\n', vm.out);
             break;
         }
 
-        interpret(line);
+        // every line gets the whole budget
+        vm.fuel = options.fuel > 0 ? options.fuel : FUEL_UNLIMITED;
+        vm.isolateFuel = vm.fuel;
+        if (interpret(&vm, line) == INTERPRET_OUT_OF_FUEL)
+        {
+            fprintf(stderr, "Out of fuel after %" PRId64 " loop iterations and calls.\n", options.fuel);
+            abandonInterpret(&vm);
+        }
     }
 }
 
-static char *readFile(const char *path)
+// NULL when the file can't be read, once err says why
+static char *readFile(const char *path, FILE *err)
 {
     FILE *file = fopen(path, "rb");
     if (file == NULL)
+    {
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    // pipes can't seek, so grow the buffer until the input runs out
+    size_t capacity = 4096;
+    size_t bytesRead = 0;
+    char *buffer = (char *)malloc(capacity);
+    for (;;)
+    {
+        if (buffer == NULL)
+        {
+            fprintf(err, "Not enough memory to read \"%s\".\n", path);
+            fclose(file);
+            return NULL;
+        }
+        bytesRead += fread(buffer + bytesRead, sizeof(char), capacity - bytesRead - 1, file);
+        if (bytesRead < capacity - 1)
+            break;
+        capacity *= 2;
+        char *grown = (char *)realloc(buffer, capacity);
+        if (grown == NULL)
+            free(buffer);
+        buffer = grown;
+    }
+    if (ferror(file))
+    {
+        fprintf(err, "Could not read file \"%s\".\n", path);
+        fclose(file);
+        free(buffer);
+        return NULL;
+    }
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+// maps a regular file read-only followed by at least one zero byte, the zero
+// tail of the last page (or a spare anonymous page when the file fills its
+// pages exactly) terminates the source without copying it. returns NULL when
+// the file can't be mapped and should be read instead
+static char *mapFile(const char *path, size_t *mappedSize)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
     {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t fileSize = (size_t)st.st_size;
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (fileSize + pageSize) & ~(pageSize - 1);
+
+    char *region = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(region, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(region, size);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    madvise(region, fileSize, MADV_SEQUENTIAL);
+    *mappedSize = size;
+    return region;
+}
+
+// "script.lox" caches to "script.loxc", any other name gets ".loxc" appended
+// NULL unless path is a regular file, anything else, a pipe or a device,
+// gets no cache next to it
+static char *cachePath(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return NULL;
 
-    char *buffer = (char *)malloc(fileSize + 1);
-    if (buffer == NULL)
+    size_t length = strlen(path);
+    bool isLox = length > 4 && strcmp(path + length - 4, ".lox") == 0;
+    char *cache = (char *)malloc(length + 6);
+    if (cache == NULL)
     {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         exit(74);
     }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize)
+    strcpy(cache, path);
+    strcpy(cache + length, isLox ? "c" : ".loxc");
+    return cache;
+}
+
+static void runFile(const char *path)
+{
+    bool lazy = options.lazy;
+    size_t mappedSize = 0;
+    char *source = mapFile(path, &mappedSize);
+    if (source == NULL)
+        source = readFile(path, stderr);
+    if (source == NULL)
+        exit(74);
+
+    size_t sourceLength;
+    uint64_t sourceHash = hashSource(source, &sourceLength);
+    char *cache = cachePath(path);
+    CacheImage image = {NULL, 0};
+
+    // the script is compiled into a program isolates share, unless a lazy
+    // compile has to write into it or an image has already interned its own
+    // strings
+    Program program = {NULL, NULL, {0, 0, NULL}, NULL, 0};
+    bool shared = !lazy && options.imagePath == NULL;
+    ObjFunction *function;
+    bool compiled;
+    if (shared)
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        compiled = cache == NULL || !loadProgram(&program, cache, sourceHash, sourceLength, &image);
+        if (compiled && !compileProgram(&program, source))
+            exit(65);
+        startVM(&program);
+        function = program.script;
+        if (compiled && cache != NULL)
+            writeCache(&vm, cache, function, sourceHash, sourceLength);
+    }
+    else
+    {
+        startVM(NULL);
+        function = cache == NULL ? NULL : loadCache(&vm, cache, sourceHash, sourceLength, &image);
+        compiled = function == NULL;
+        if (compiled)
+        {
+            function = compile(&vm, source, lazy);
+            if (function == NULL)
+                exit(65);
+            // a lazy run caches after running, once bodies it never called are compiled
+            if (!lazy && cache != NULL)
+                writeCache(&vm, cache, function, sourceHash, sourceLength);
+        }
+    }
+
+    vm.out = openOutput(options.asyncOutput);
+    vm.fuel = options.fuel > 0 ? options.fuel : FUEL_UNLIMITED;
+    vm.isolateFuel = vm.fuel;
+    InterpretResult result = interpretFunction(&vm, function);
+    if (result == INTERPRET_OUT_OF_FUEL)
+        fprintf(stderr, "Out of fuel after %" PRId64 " loop iterations and calls.\n", options.fuel);
+
+    // skipped bodies point into the source, so it has to outlive the run
+    if (lazy && compiled && cache != NULL && result == INTERPRET_OK)
+        writeCache(&vm, cache, function, sourceHash, sourceLength);
+    if (options.snapshotPath != NULL && result == INTERPRET_OK &&
+        !writeSnapshot(&vm, options.snapshotPath))
+    {
+        fprintf(stderr, "Could not write snapshot \"%s\".\n", options.snapshotPath);
         exit(74);
     }
-    buffer[bytesRead] = '\0';
+    freeVM(&vm);
+    freeProgram(&program);
+    closeCache(&image);
+    if (mappedSize > 0)
+        munmap(source, mappedSize);
+    else
+        free(source);
+    free(cache);
 
-    fclose(file);
-    return buffer;
+    if (result != INTERPRET_OK)
+        exit(exitStatus(result));
 }
 
-static void runFile(const char *path)
+typedef struct
 {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    const char *path;
+    int status;     // what running the script on its own would exit with
+    double seconds;
+    char *output;   // what it printed, held until every earlier script's is out
+    size_t outputSize;
+    char *errors;
+    size_t errorsSize;
+    bool done;
+
+    // while a worker is running it
+    VM *vm;
+    char *source;
+    ObjFunction *function; // until its first turn
+    FILE *out;
+    FILE *err;
+    double start;
+    int64_t fuelUsed;
+} Job;
+
+typedef struct
+{
+    Job *jobs;
+    int count;
+    _Atomic int next; // the first job no worker has taken
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
 
-    if (result == INTERPRET_COMPILE_ERROR)
+// the most scripts one worker time-slices between
+#define RING_MAX 32
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static FILE *captureStream(char **buffer, size_t *size)
+{
+    FILE *stream = open_memstream(buffer, size);
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Not enough memory to capture a script's output.\n");
+        exit(74);
+    }
+    return stream;
+}
+
+// compiles a script into a fresh vm, its output and errors kept in memory.
+// false when it has already failed
+static bool startJob(Job *job)
+{
+    job->start = now();
+    job->out = captureStream(&job->output, &job->outputSize);
+    job->err = captureStream(&job->errors, &job->errorsSize);
+    job->fuelUsed = 0;
+
+    job->source = readFile(job->path, job->err);
+    if (job->source == NULL)
+    {
+        job->status = 74;
+        return false;
+    }
+
+    job->vm = (VM *)malloc(sizeof(VM));
+    if (job->vm == NULL)
+    {
+        fprintf(stderr, "Not enough memory for a script's vm.\n");
+        exit(74);
+    }
+    initVM(job->vm, NULL);
+    job->vm->isolateFuel = options.fuel > 0 ? options.fuel : FUEL_UNLIMITED;
+    job->vm->out = job->out;
+    job->vm->err = job->err;
+    job->function = compile(job->vm, job->source, options.lazy);
+    if (job->function == NULL)
+    {
+        job->status = 65;
+        return false;
+    }
+    return true;
+}
+
+// runs a script for one slice, or for all of its budget when the worker
+// doesn't time-slice. true once it has ended
+static bool runTurn(Job *job)
+{
+    VM *vm = job->vm;
+    int64_t fuel = options.fuel > 0 ? options.fuel - job->fuelUsed : FUEL_UNLIMITED;
+    if (options.slice > 0 && options.slice < fuel)
+        fuel = options.slice;
+    vm->fuel = fuel;
+
+    InterpretResult result = job->function != NULL ? interpretFunction(vm, job->function) : resumeInterpret(vm);
+    job->function = NULL;
+    job->fuelUsed += fuel - (vm->fuel > 0 ? vm->fuel : 0);
+    if (result == INTERPRET_OUT_OF_FUEL && (options.fuel == 0 || job->fuelUsed < options.fuel))
+        return false;
+
+    if (result == INTERPRET_OUT_OF_FUEL)
+        fprintf(vm->err, "Out of fuel after %" PRId64 " loop iterations and calls.\n", job->fuelUsed);
+    job->status = exitStatus(result);
+    return true;
+}
+
+static void finishJob(Batch *batch, Job *job)
+{
+    // skipped bodies point into the source
+    if (job->vm != NULL)
+    {
+        freeVM(job->vm);
+        free(job->vm);
+    }
+    free(job->source);
+    fclose(job->out);
+    fclose(job->err);
+    job->seconds = now() - job->start;
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// each worker takes scripts while its ring has room and gives them turns in
+// order until they end. without --slice a turn lasts the whole run, so the
+// ring holds one script and a worker runs them one after another
+static void *runWorker(void *argument)
+{
+    Batch *batch = (Batch *)argument;
+    Job *ring[RING_MAX];
+    int ringSize = options.slice > 0 ? RING_MAX : 1;
+    int active = 0;
+    bool claimedAll = false;
+
+    for (;;)
+    {
+        while (active < ringSize && !claimedAll)
+        {
+            int index = atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed);
+            claimedAll = index >= batch->count;
+            if (claimedAll)
+                break;
+            Job *job = &batch->jobs[index];
+            if (startJob(job))
+                ring[active++] = job;
+            else
+                finishJob(batch, job);
+        }
+        if (active == 0)
+            break;
+
+        for (int i = 0; i < active;)
+        {
+            if (runTurn(ring[i]))
+            {
+                finishJob(batch, ring[i]);
+                ring[i] = ring[--active];
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// runs every script on a pool of threads, replaying each one's output in
+// the order given as soon as it and the ones before it are done. exits with
+// the worst status any script had
+static void runJobs(int workers, int count, const char **paths)
+{
+    double start = now();
+    Batch batch;
+    batch.jobs = (Job *)calloc((size_t)count, sizeof(Job));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)workers);
+    if (batch.jobs == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Not enough memory for %d scripts.\n", count);
+        exit(74);
+    }
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        batch.jobs[i].path = paths[i];
+    }
+
+    if (workers > count)
+        workers = count;
+    int started = 0;
+    for (; started < workers; started++)
+    {
+        if (pthread_create(&threads[started], NULL, runWorker, &batch) != 0)
+            break;
+    }
+    if (started == 0)
+    {
+        fprintf(stderr, "Could not start a worker thread.\n");
+        exit(74);
+    }
+
+    int status = 0;
+    int failed = 0;
+    double scriptSeconds = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Job *job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done)
+        {
+            pthread_cond_wait(&batch.finished, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        fwrite(job->output, 1, job->outputSize, stdout);
+        fflush(stdout);
+        fwrite(job->errors, 1, job->errorsSize, stderr);
+        free(job->output);
+        free(job->errors);
+
+        scriptSeconds += job->seconds;
+        if (job->status != 0)
+        {
+            fprintf(stderr, "%s: exit %d after %.3fs\n", job->path, job->status, job->seconds);
+            failed++;
+        }
+        if (job->status > status)
+            status = job->status;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    fprintf(stderr, "%d scripts, %d failed, %.3fs (%.3fs running scripts on %d threads)\n",
+            count, failed, now() - start, scriptSeconds, started);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.finished);
+    free(threads);
+    free(batch.jobs);
+    exit(status);
+}
+
+// a worker calls handle() on each line the parent sends it, and what one
+// line prints goes out in a single write so lines from different workers
+// don't tear. there is no collector, so the heap grows with whatever the
+// lines allocate. exits with 70 when any line raised an error
+static void runWorkerProcess(Value handler, int input)
+{
+    FILE *lines = fdopen(input, "r");
+    if (lines == NULL)
+        _exit(74);
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    int status = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, lines)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            length--;
+        push(&vm, handler);
+        push(&vm, copyText(&vm, line, (int)length));
+        Value result;
+        if (interpretCall(&vm, 1, &result) != INTERPRET_OK)
+            status = 70;
+        fflush(stdout);
+    }
+
+    // exit() could flush the stdin buffer inherited from the parent
+    _exit(status);
+}
+
+// compiles the script, seals its code and runs it once, then forks workers
+// that inherit all of it. the parent hands stdin's lines out round-robin and
+// exits with the worst status a worker had
+static void runPrefork(int workers, const char *path)
+{
+    char *source = readFile(path, stderr);
+    if (source == NULL)
+        exit(74);
+    Program program;
+    if (!compileProgram(&program, source))
         exit(65);
-    if (result == INTERPERT_RUNTIME_ERROR)
+    free(source);
+    if (!sealProgram(&program))
+    {
+        fprintf(stderr, "Could not seal the program.\n");
+        exit(74);
+    }
+
+    startVM(&program);
+    InterpretResult result = interpretFunction(&vm, program.script);
+    if (result != INTERPRET_OK)
+        exit(exitStatus(result));
+    Value handler;
+    if (!tableGet(&vm.globals, copyString(&vm, "handle", 6), &handler))
+    {
+        fprintf(stderr, "A script run with --prefork must define handle(line).\n");
         exit(70);
+    }
+
+    // anything still buffered would be printed by every worker too
+    fflush(stdout);
+    FILE **inputs = (FILE **)malloc(sizeof(FILE *) * (size_t)workers);
+    pid_t *pids = (pid_t *)malloc(sizeof(pid_t) * (size_t)workers);
+    if (inputs == NULL || pids == NULL)
+    {
+        fprintf(stderr, "Not enough memory for %d workers.\n", workers);
+        exit(74);
+    }
+    for (int i = 0; i < workers; i++)
+    {
+        int fds[2];
+        if (pipe(fds) == -1 || (pids[i] = fork()) == -1)
+        {
+            perror("Could not start a worker");
+            exit(74);
+        }
+        if (pids[i] == 0)
+        {
+            close(fds[1]);
+            for (int j = 0; j < i; j++)
+            {
+                fclose(inputs[j]);
+            }
+            runWorkerProcess(handler, fds[0]);
+        }
+        close(fds[0]);
+        inputs[i] = fdopen(fds[1], "w");
+    }
+
+    // a worker that died shows in its status, not as a signal here
+    signal(SIGPIPE, SIG_IGN);
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    for (int next = 0; (length = getline(&line, &capacity, stdin)) != -1; next = (next + 1) % workers)
+    {
+        fwrite(line, 1, (size_t)length, inputs[next]);
+    }
+    free(line);
+
+    int status = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        fclose(inputs[i]);
+    }
+    for (int i = 0; i < workers; i++)
+    {
+        int worker;
+        if (waitpid(pids[i], &worker, 0) == -1)
+            continue;
+        int code = WIFEXITED(worker) ? WEXITSTATUS(worker) : 70;
+        if (code > status)
+            status = code;
+    }
+    exit(status);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--lazy] [--fuel N] [--async-output] [--image path] [--snapshot path] [path]\n"
+                    "       clox [--lazy] [--fuel N] [--slice N] --jobs N path...\n"
+                    "       clox [--jobs N] [--fuel N] --serve socket [prelude]\n"
+                    "       clox --prefork N path < lines\n");
+    exit(64);
 }
 
 int main(int argc, const char *argv[])
 {
-    initVM();
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        if (strcmp(argv[arg], "--lazy") == 0)
+            options.lazy = true;
+        else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+            options.imagePath = argv[++arg];
+        else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc)
+            options.snapshotPath = argv[++arg];
+        else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            options.jobs = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc)
+            options.servePath = argv[++arg];
+        else if (strcmp(argv[arg], "--fuel") == 0 && arg + 1 < argc && atoll(argv[arg + 1]) > 0)
+            options.fuel = atoll(argv[++arg]);
+        else if (strcmp(argv[arg], "--slice") == 0 && arg + 1 < argc && atoll(argv[arg + 1]) > 0)
+            options.slice = atoll(argv[++arg]);
+        else if (strcmp(argv[arg], "--prefork") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+            options.prefork = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--async-output") == 0)
+            options.asyncOutput = true;
+        else
+            usage();
+    }
+
+    if (options.prefork > 0)
+    {
+        if (arg + 1 != argc || options.lazy || options.imagePath != NULL || options.snapshotPath != NULL ||
+            options.jobs > 0 || options.servePath != NULL || options.asyncOutput || options.fuel > 0 ||
+            options.slice > 0)
+            usage();
+        runPrefork(options.prefork, argv[arg]);
+    }
+
+    // the prelude is compiled once, every worker runs it to warm its vm. the
+    // prelude runs unmetered, --fuel is each request's budget
+    if (options.servePath != NULL)
+    {
+        if (arg + 1 < argc || options.lazy || options.imagePath != NULL || options.snapshotPath != NULL ||
+            options.asyncOutput || options.slice > 0)
+            usage();
+        char *source = arg < argc ? readFile(argv[arg], stderr) : strdup("");
+        Program prelude;
+        if (source == NULL)
+            exit(74);
+        if (!compileProgram(&prelude, source))
+            exit(65);
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        serve(options.servePath, &prelude, options.jobs > 0 ? options.jobs : cores > 0 ? (int)cores : 1,
+              options.fuel);
+    }
+
+    if (options.slice > 0 && options.jobs == 0)
+        usage();
+
+    // each script in a batch starts from a fresh vm
+    if (options.jobs > 0)
+    {
+        if (arg == argc || options.imagePath != NULL || options.snapshotPath != NULL || options.asyncOutput)
+            usage();
+        runJobs(options.jobs, argc - arg, argv + arg);
+    }
 
-    if (argc == 1)
+    if (arg == argc && !options.lazy && options.snapshotPath == NULL)
     {
+        startVM(NULL);
+        vm.out = openOutput(options.asyncOutput);
         repl();
+        freeVM(&vm);
     }
-    else if (argc == 2)
+    else if (arg + 1 == argc)
     {
-        runFile(argv[1]);
+        runFile(argv[arg]);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
-    freeVM();
+    closeSnapshot(&snapshot);
     return 0;
 }
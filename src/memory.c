@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "isolate.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -17,10 +18,25 @@ void *reallocate(void *pointer, __attribute__((unused)) size_t oldSize, size_t n
     return result;
 }
 
+// a finished coroutine gives its stacks back early, the object outlives them
+void freeFiber(Fiber *fiber)
+{
+    FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    fiber->frames = NULL;
+    fiber->stack = NULL;
+}
+
 static void freeObject(Obj *object)
 {
     switch (object->type)
     {
+    case OBJ_CHANNEL:
+    {
+        releaseChannel(((ObjChannel *)object)->channel);
+        FREE(ObjChannel, object);
+        break;
+    }
     case OBJ_CLOSURE:
     {
         ObjClosure *closure = (ObjClosure *)object;
@@ -28,20 +44,47 @@ static void freeObject(Obj *object)
         FREE(ObjClosure, object);
         break;
     }
+    case OBJ_ISOLATE:
+    {
+        freeIsolate(((ObjIsolate *)object)->isolate);
+        FREE(ObjIsolate, object);
+        break;
+    }
     case OBJ_NATIVE:
     {
         FREE(ObjNative, object);
         break;
     }
+    case OBJ_ROPE:
+    {
+        ObjString *flat = ((ObjRope *)object)->flat;
+        if (flat != NULL)
+            reallocate(flat, sizeof(ObjString) + flat->length + 1, 0);
+        FREE(ObjRope, object);
+        break;
+    }
+    case OBJ_SLICE:
+    {
+        FREE(ObjSlice, object);
+        break;
+    }
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
         reallocate(object, sizeof(ObjString) + string->length + 1, 0);
         break;
     }
+    case OBJ_COROUTINE:
+    {
+        freeFiber(&((ObjCoroutine *)object)->fiber);
+        FREE(ObjCoroutine, object);
+        break;
+    }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
+        if (function->upvalueNames != NULL)
+            FREE_ARRAY(ObjString *, function->upvalueNames, function->upvalueCount);
         freeChunk(&function->chunk);
         FREE(ObjFunction, object);
         break;
@@ -54,9 +97,9 @@ static void freeObject(Obj *object)
     }
 }
 
-void freeObjects()
+void freeObjects(Obj *objects)
 {
-    Obj *object = vm.objects;
+    Obj *object = objects;
     while (object != NULL)
     {
         Obj *next = object->next;
@@ -1,10 +1,16 @@
+#include <limits.h>
+#include <string.h>
 #include <time.h>
 
+#include "compiler.h"
+#include "isolate.h"
+#include "natives.h"
+#include "number.h"
 #include "value.h"
 
 #define UNUSED __attribute__((unused))
 
-Value n_clock(int argc, UNUSED Value *argv)
+Value n_clock(UNUSED VM *vm, int argc, UNUSED Value *argv)
 {
     if (argc != 0)
     {
@@ -13,16 +19,368 @@ Value n_clock(int argc, UNUSED Value *argv)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-Value n_triple(int argc, Value *argv)
+Value n_triple(UNUSED VM *vm, int argc, Value *argv)
 {
     if (argc != 1)
     {
         return ERROR_ARGC;
     }
-    else if (!IS_NUMBER(argv[0]))
+    else if (!IS_NUMERIC(argv[0]))
     {
         return ERROR_ARGV;
     }
 
-    return NUMBER_VAL(AS_NUMBER(argv[0]) * 3);
-}
\ No newline at end of file
+    int64_t tripled;
+    if (IS_INT(argv[0]) && !__builtin_mul_overflow(AS_INT(argv[0]), 3, &tripled))
+        return INT_VAL(tripled);
+    return NUMBER_VAL(AS_FLOAT(argv[0]) * 3);
+}
+
+// a whole number usable as a string position
+static bool isIndex(Value value)
+{
+    if (IS_INT(value))
+        return AS_INT(value) >= 0 && AS_INT(value) <= INT_MAX;
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= INT_MAX &&
+           AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+static int asIndex(Value value)
+{
+    return IS_INT(value) ? (int)AS_INT(value) : (int)AS_NUMBER(value);
+}
+
+static int findText(const char *chars, int length, const char *needle, int needleLength)
+{
+    if (needleLength == 0)
+        return 0;
+
+    const char *end = chars + length - needleLength + 1;
+    for (const char *p = chars; p < end; p++)
+    {
+        p = memchr(p, needle[0], end - p);
+        if (p == NULL)
+            break;
+        if (memcmp(p, needle, needleLength) == 0)
+            return (int)(p - chars);
+    }
+    return -1;
+}
+
+// part of a string: short pieces are copied into the value, longer ones
+// share the original's storage
+static Value substring(VM *vm, Value *text, int start, int length)
+{
+    if (length <= SMALL_STRING_MAX)
+        return copyText(vm, textChars(text) + start, length);
+    return OBJ_VAL(newSlice(vm, *text, start, length));
+}
+
+// substr(s, start, length), clamped to the end of s
+Value n_substr(VM *vm, int argc, Value *argv)
+{
+    if (argc != 3)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_TEXT(argv[0]) || !isIndex(argv[1]) || !isIndex(argv[2]))
+    {
+        return ERROR_ARGV;
+    }
+
+    int length = textLength(argv[0]);
+    int start = asIndex(argv[1]);
+    int count = asIndex(argv[2]);
+    if (start > length)
+        start = length;
+    if (count > length - start)
+        count = length - start;
+
+    if (count == length)
+        return argv[0];
+    return substring(vm, &argv[0], start, count);
+}
+
+// where needle first starts in text at or after from, -1 when it doesn't
+static int findFrom(Value *text, Value *needle, int from)
+{
+    int length = textLength(*text);
+    if (from > length)
+        from = length;
+    int found = findText(textChars(text) + from, length - from, textChars(needle), textLength(*needle));
+    return found < 0 ? -1 : from + found;
+}
+
+// indexOf(s, needle) or indexOf(s, needle, from), -1 when needle isn't in s
+// at or after from. walking a line with from set past the last match reads
+// each field once
+Value n_indexOf(UNUSED VM *vm, int argc, Value *argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_TEXT(argv[0]) || !IS_TEXT(argv[1]) || (argc == 3 && !isIndex(argv[2])))
+    {
+        return ERROR_ARGV;
+    }
+
+    return INT_VAL(findFrom(&argv[0], &argv[1], argc == 3 ? asIndex(argv[2]) : 0));
+}
+
+// split(s, separator, n), the nth field of s counting from 0, or nil when
+// there are fewer. the language has no lists to hand back all of them, and
+// each call scans from the start, so walk a whole line with indexOf(s,
+// separator, from) and substr instead
+Value n_split(VM *vm, int argc, Value *argv)
+{
+    if (argc != 3)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_TEXT(argv[0]) || !IS_TEXT(argv[1]) || textLength(argv[1]) == 0 ||
+             !isIndex(argv[2]))
+    {
+        return ERROR_ARGV;
+    }
+
+    int length = textLength(argv[0]);
+    int separatorLength = textLength(argv[1]);
+    int field = asIndex(argv[2]);
+
+    int start = 0;
+    for (;;)
+    {
+        int found = findFrom(&argv[0], &argv[1], start);
+        int end = found < 0 ? length : found;
+        if (field == 0)
+            return substring(vm, &argv[0], start, end - start);
+        if (found < 0)
+            return NIL_VAL;
+        start = end + separatorLength;
+        field--;
+    }
+}
+
+// str(n), the text print shows for a number. it reads back as the same
+// number
+Value n_str(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_NUMERIC(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+
+    char text[NUMBER_TEXT_MAX];
+    int length = IS_INT(argv[0]) ? formatInteger(AS_INT(argv[0]), text)
+                                 : formatNumber(AS_NUMBER(argv[0]), text);
+    return copyText(vm, text, length);
+}
+
+// spawn(fn, args...) runs fn(args...) on a thread of its own, in a vm
+// seeded with copies of the globals and the arguments
+Value n_spawn(VM *vm, int argc, Value *argv)
+{
+    if (argc < 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_CLOSURE(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+    else if (AS_CLOSURE(argv[0])->function->arity != argc - 1)
+    {
+        return ERROR_ARGC;
+    }
+
+    Isolate *isolate = spawnIsolate(vm, AS_CLOSURE(argv[0]), argc - 1, argv + 1);
+    if (isolate == NULL)
+        return ERROR_ARGV;
+    return OBJ_VAL(newIsolate(vm, isolate));
+}
+
+// join(isolate), what its function returned once it has finished. nil when
+// it failed or returned something other than a number, string or channel
+Value n_join(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_ISOLATE(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+
+    return joinIsolate(vm, AS_ISOLATE(argv[0]));
+}
+
+// channel() or channel(capacity), a queue any isolate it reaches can use
+Value n_channel(VM *vm, int argc, Value *argv)
+{
+    if (argc > 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (argc == 1 && (!isIndex(argv[0]) || asIndex(argv[0]) == 0 ||
+                           asIndex(argv[0]) > CHANNEL_MAX_CAPACITY))
+    {
+        return ERROR_ARGV;
+    }
+
+    int capacity = argc == 1 ? asIndex(argv[0]) : CHANNEL_DEFAULT_CAPACITY;
+    return OBJ_VAL(newChannel(vm, createChannel(capacity)));
+}
+
+// send(channel, value), waiting while the channel is full. only nil,
+// booleans, numbers, strings and channels can be sent
+Value n_send(UNUSED VM *vm, int argc, Value *argv)
+{
+    if (argc != 2)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_CHANNEL(argv[0]) || !channelSend(AS_CHANNEL(argv[0]), argv[1]))
+    {
+        return ERROR_ARGV;
+    }
+
+    return NIL_VAL;
+}
+
+// recv(channel), waiting while the channel is empty
+Value n_recv(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_CHANNEL(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+
+    return channelReceive(vm, AS_CHANNEL(argv[0]));
+}
+
+// coroutine(fn), fn run on a stack of its own by resume() or next(). fn
+// takes no argument or one, the value the first resume passes
+Value n_coroutine(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_CLOSURE(argv[0]) || AS_CLOSURE(argv[0])->function->arity > 1)
+    {
+        return ERROR_ARGV;
+    }
+
+    ObjFunction *function = AS_CLOSURE(argv[0])->function;
+    if (function->lazySource != NULL && !compileLazy(vm, function))
+        return ERROR_ARGV;
+    return OBJ_VAL(newCoroutine(vm, AS_CLOSURE(argv[0])));
+}
+
+// resume(co) or resume(co, value), runs co until it yields or returns and
+// evaluates to what it yielded or returned
+Value n_resume(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1 && argc != 2)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_COROUTINE(argv[0]) ||
+             !resumeCoroutine(vm, AS_COROUTINE(argv[0]), argc == 2 ? argv[1] : NIL_VAL, false, argv - 1))
+    {
+        return ERROR_ARGV;
+    }
+
+    return SWITCHED;
+}
+
+// yield() or yield(value) inside a coroutine, evaluates to the value the
+// coroutine is next resumed with
+Value n_yield(VM *vm, int argc, Value *argv)
+{
+    if (argc > 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!yieldCoroutine(vm, argc == 1 ? argv[0] : NIL_VAL, argv - 1))
+    {
+        return ERROR_ARGV;
+    }
+
+    return SWITCHED;
+}
+
+// next(co), co used as a generator: the next value it yields, nil once it
+// has returned
+Value n_next(VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_COROUTINE(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+
+    if (AS_COROUTINE(argv[0])->state == COROUTINE_DONE)
+        return NIL_VAL;
+    if (!resumeCoroutine(vm, AS_COROUTINE(argv[0]), NIL_VAL, true, argv - 1))
+        return ERROR_ARGV;
+    return SWITCHED;
+}
+
+// done(co), whether co has returned
+Value n_done(UNUSED VM *vm, int argc, Value *argv)
+{
+    if (argc != 1)
+    {
+        return ERROR_ARGC;
+    }
+    else if (!IS_COROUTINE(argv[0]))
+    {
+        return ERROR_ARGV;
+    }
+
+    return BOOL_VAL(AS_COROUTINE(argv[0])->state == COROUTINE_DONE);
+}
+
+const NativeDef nativeDefs[] = {
+    {"clock", n_clock},
+    {"triple", n_triple},
+    {"substr", n_substr},
+    {"indexOf", n_indexOf},
+    {"split", n_split},
+    {"str", n_str},
+    {"spawn", n_spawn},
+    {"join", n_join},
+    {"channel", n_channel},
+    {"send", n_send},
+    {"recv", n_recv},
+    {"coroutine", n_coroutine},
+    {"resume", n_resume},
+    {"yield", n_yield},
+    {"next", n_next},
+    {"done", n_done},
+    {NULL, NULL},
+};
+
+const NativeDef *findNative(const char *name)
+{
+    for (const NativeDef *def = nativeDefs; def->name != NULL; def++)
+    {
+        if (strcmp(def->name, name) == 0)
+            return def;
+    }
+    return NULL;
+}
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// decimal to double conversion for number tokens, digits with an optional
+// fraction. the result is always the correctly rounded double, bit for bit
+// what strtod returns, but the common cases never need a terminator or a
+// locale lookup
+
+typedef struct
+{
+    uint64_t high;
+    uint64_t low;
+    int exponent;
+} PowerOfFive;
+
+// 5^q ~= (high:low) * 2^exponent, truncated to 128 bits with the top bit set
+#define POWER_MIN -64
+
+static const PowerOfFive powersOfFive[] = {
+    {0xa87fea27a539e9a5u, 0x3f2398d747b36224u, -276}, // 5^-64
+    {0xd29fe4b18e88640eu, 0x8eec7f0d19a03aadu, -274}, // 5^-63
+    {0x83a3eeeef9153e89u, 0x1953cf68300424acu, -271}, // 5^-62
+    {0xa48ceaaab75a8e2bu, 0x5fa8c3423c052dd7u, -269}, // 5^-61
+    {0xcdb02555653131b6u, 0x3792f412cb06794du, -267}, // 5^-60
+    {0x808e17555f3ebf11u, 0xe2bbd88bbee40bd0u, -264}, // 5^-59
+    {0xa0b19d2ab70e6ed6u, 0x5b6aceaeae9d0ec4u, -262}, // 5^-58
+    {0xc8de047564d20a8bu, 0xf245825a5a445275u, -260}, // 5^-57
+    {0xfb158592be068d2eu, 0xeed6e2f0f0d56712u, -258}, // 5^-56
+    {0x9ced737bb6c4183du, 0x55464dd69685606bu, -255}, // 5^-55
+    {0xc428d05aa4751e4cu, 0xaa97e14c3c26b886u, -253}, // 5^-54
+    {0xf53304714d9265dfu, 0xd53dd99f4b3066a8u, -251}, // 5^-53
+    {0x993fe2c6d07b7fabu, 0xe546a8038efe4029u, -248}, // 5^-52
+    {0xbf8fdb78849a5f96u, 0xde98520472bdd033u, -246}, // 5^-51
+    {0xef73d256a5c0f77cu, 0x963e66858f6d4440u, -244}, // 5^-50
+    {0x95a8637627989aadu, 0xdde7001379a44aa8u, -241}, // 5^-49
+    {0xbb127c53b17ec159u, 0x5560c018580d5d52u, -239}, // 5^-48
+    {0xe9d71b689dde71afu, 0xaab8f01e6e10b4a6u, -237}, // 5^-47
+    {0x9226712162ab070du, 0xcab3961304ca70e8u, -234}, // 5^-46
+    {0xb6b00d69bb55c8d1u, 0x3d607b97c5fd0d22u, -232}, // 5^-45
+    {0xe45c10c42a2b3b05u, 0x8cb89a7db77c506au, -230}, // 5^-44
+    {0x8eb98a7a9a5b04e3u, 0x77f3608e92adb242u, -227}, // 5^-43
+    {0xb267ed1940f1c61cu, 0x55f038b237591ed3u, -225}, // 5^-42
+    {0xdf01e85f912e37a3u, 0x6b6c46dec52f6688u, -223}, // 5^-41
+    {0x8b61313bbabce2c6u, 0x2323ac4b3b3da015u, -220}, // 5^-40
+    {0xae397d8aa96c1b77u, 0xabec975e0a0d081au, -218}, // 5^-39
+    {0xd9c7dced53c72255u, 0x96e7bd358c904a21u, -216}, // 5^-38
+    {0x881cea14545c7575u, 0x7e50d64177da2e54u, -213}, // 5^-37
+    {0xaa242499697392d2u, 0xdde50bd1d5d0b9e9u, -211}, // 5^-36
+    {0xd4ad2dbfc3d07787u, 0x955e4ec64b44e864u, -209}, // 5^-35
+    {0x84ec3c97da624ab4u, 0xbd5af13bef0b113eu, -206}, // 5^-34
+    {0xa6274bbdd0fadd61u, 0xecb1ad8aeacdd58eu, -204}, // 5^-33
+    {0xcfb11ead453994bau, 0x67de18eda5814af2u, -202}, // 5^-32
+    {0x81ceb32c4b43fcf4u, 0x80eacf948770ced7u, -199}, // 5^-31
+    {0xa2425ff75e14fc31u, 0xa1258379a94d028du, -197}, // 5^-30
+    {0xcad2f7f5359a3b3eu, 0x096ee45813a04330u, -195}, // 5^-29
+    {0xfd87b5f28300ca0du, 0x8bca9d6e188853fcu, -193}, // 5^-28
+    {0x9e74d1b791e07e48u, 0x775ea264cf55347du, -190}, // 5^-27
+    {0xc612062576589ddau, 0x95364afe032a819du, -188}, // 5^-26
+    {0xf79687aed3eec551u, 0x3a83ddbd83f52204u, -186}, // 5^-25
+    {0x9abe14cd44753b52u, 0xc4926a9672793542u, -183}, // 5^-24
+    {0xc16d9a0095928a27u, 0x75b7053c0f178293u, -181}, // 5^-23
+    {0xf1c90080baf72cb1u, 0x5324c68b12dd6338u, -179}, // 5^-22
+    {0x971da05074da7beeu, 0xd3f6fc16ebca5e03u, -176}, // 5^-21
+    {0xbce5086492111aeau, 0x88f4bb1ca6bcf584u, -174}, // 5^-20
+    {0xec1e4a7db69561a5u, 0x2b31e9e3d06c32e5u, -172}, // 5^-19
+    {0x9392ee8e921d5d07u, 0x3aff322e62439fcfu, -169}, // 5^-18
+    {0xb877aa3236a4b449u, 0x09befeb9fad487c2u, -167}, // 5^-17
+    {0xe69594bec44de15bu, 0x4c2ebe687989a9b3u, -165}, // 5^-16
+    {0x901d7cf73ab0acd9u, 0x0f9d37014bf60a10u, -162}, // 5^-15
+    {0xb424dc35095cd80fu, 0x538484c19ef38c94u, -160}, // 5^-14
+    {0xe12e13424bb40e13u, 0x2865a5f206b06fb9u, -158}, // 5^-13
+    {0x8cbccc096f5088cbu, 0xf93f87b7442e45d3u, -155}, // 5^-12
+    {0xafebff0bcb24aafeu, 0xf78f69a51539d748u, -153}, // 5^-11
+    {0xdbe6fecebdedd5beu, 0xb573440e5a884d1bu, -151}, // 5^-10
+    {0x89705f4136b4a597u, 0x31680a88f8953030u, -148}, // 5^-9
+    {0xabcc77118461cefcu, 0xfdc20d2b36ba7c3du, -146}, // 5^-8
+    {0xd6bf94d5e57a42bcu, 0x3d32907604691b4cu, -144}, // 5^-7
+    {0x8637bd05af6c69b5u, 0xa63f9a49c2c1b10fu, -141}, // 5^-6
+    {0xa7c5ac471b478423u, 0x0fcf80dc33721d53u, -139}, // 5^-5
+    {0xd1b71758e219652bu, 0xd3c36113404ea4a8u, -137}, // 5^-4
+    {0x83126e978d4fdf3bu, 0x645a1cac083126e9u, -134}, // 5^-3
+    {0xa3d70a3d70a3d70au, 0x3d70a3d70a3d70a3u, -132}, // 5^-2
+    {0xccccccccccccccccu, 0xccccccccccccccccu, -130}, // 5^-1
+    {0x8000000000000000u, 0x0000000000000000u, -127}, // 5^0
+};
+
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static double slowParse(const char *start, int length)
+{
+    char buffer[64];
+    char *chars = length < (int)sizeof(buffer) ? buffer : malloc(length + 1);
+    if (chars == NULL)
+        exit(1);
+    memcpy(chars, start, length);
+    chars[length] = '\0';
+
+    double value = strtod(chars, NULL);
+    if (chars != buffer)
+        free(chars);
+    return value;
+}
+
+// Eisel-Lemire: multiplies the normalized digits by a 128-bit power of five
+// and reads the mantissa off the top of the product. returns false when the
+// product is too close to a rounding boundary for the truncated table to decide
+static bool eiselLemire(uint64_t digits, int power, double *value)
+{
+    const PowerOfFive *five = &powersOfFive[power - POWER_MIN];
+    int leadingZeros = __builtin_clzll(digits);
+    uint64_t normalized = digits << leadingZeros;
+
+    unsigned __int128 low = (unsigned __int128)normalized * five->low;
+    unsigned __int128 high = (unsigned __int128)normalized * five->high + (uint64_t)(low >> 64);
+    uint64_t top = (uint64_t)(high >> 64);
+    uint64_t middle = (uint64_t)high;
+
+    // keep 54 bits, the last one decides rounding
+    int upperBit = (int)(top >> 63);
+    int shift = upperBit + 9;
+    uint64_t truncated = top >> shift;
+    uint64_t rest = top & ((1ull << shift) - 1);
+
+    // the true product lies in [product, product + 2^64), within one unit of middle
+    if ((truncated & 1) && rest == 0 && middle == 0)
+        return false;
+    if (!(truncated & 1) && rest == (1ull << shift) - 1 && middle == UINT64_MAX)
+        return false;
+
+    uint64_t mantissa = (truncated + 1) >> 1;
+    int exponent = shift + 1 + 128 + five->exponent + power - leadingZeros;
+    if (mantissa == (1ull << 53))
+    {
+        mantissa >>= 1;
+        exponent++;
+    }
+
+    int biased = exponent + 52 + 1023;
+    if (biased <= 0 || biased >= 2047)
+        return false;
+
+    uint64_t bits = ((uint64_t)biased << 52) | (mantissa & ((1ull << 52) - 1));
+    memcpy(value, &bits, sizeof(bits));
+    return true;
+}
+
+double parseNumber(const char *start, int length)
+{
+    const char *end = start + length;
+    const char *c = start;
+    uint64_t digits = 0;
+    int significant = 0;
+    int power = 0;
+
+    for (; c < end && *c != '.'; c++)
+    {
+        if (significant < 19)
+        {
+            digits = digits * 10 + (uint64_t)(*c - '0');
+            if (digits != 0)
+                significant++;
+        }
+        else
+        {
+            return slowParse(start, length);
+        }
+    }
+    if (c < end)
+    {
+        for (c++; c < end; c++)
+        {
+            if (significant == 19)
+                return slowParse(start, length);
+            digits = digits * 10 + (uint64_t)(*c - '0');
+            if (digits != 0)
+                significant++;
+            power--;
+        }
+    }
+
+    if (digits == 0)
+        return 0.0;
+
+    // both operands are exact doubles so the one rounding is the correct one
+    if (digits <= (1ull << 53) && power >= -22)
+        return (double)digits / exactPowersOfTen[-power];
+
+    double value;
+    if (power >= POWER_MIN && eiselLemire(digits, power, &value))
+        return value;
+    return slowParse(start, length);
+}
+
+// a literal without a fraction that fits in 64 bits
+bool parseInteger(const char *start, int length, int64_t *value)
+{
+    int64_t result = 0;
+    for (const char *c = start; c < start + length; c++)
+    {
+        if (*c == '.' || __builtin_mul_overflow(result, 10, &result) ||
+            __builtin_add_overflow(result, *c - '0', &result))
+        {
+            return false;
+        }
+    }
+    *value = result;
+    return true;
+}
+
+// double to decimal conversion for print and str(). the text holds the
+// fewest significant digits that parse back to the same double, laid out
+// like %g would but with the exponent only below 1e-4 or from 1e17 on
+
+// the significant digits are whole numbers below this
+#define DIGITS_MAX 100000000000000000ull
+
+int formatInteger(int64_t value, char *buffer)
+{
+    char digits[24];
+    char *start = digits + sizeof(digits);
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do
+    {
+        *--start = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+        *--start = '-';
+
+    int length = (int)(digits + sizeof(digits) - start);
+    memcpy(buffer, start, length);
+    return length;
+}
+
+// writes digits * 10^(exponent - count + 1), where the first of count digits
+// is not zero and the last isn't either unless it is the only one
+static int layout(char *buffer, const char *digits, int count, int exponent)
+{
+    char *c = buffer;
+    if (exponent < -4 || exponent >= 17)
+    {
+        *c++ = digits[0];
+        if (count > 1)
+        {
+            *c++ = '.';
+            memcpy(c, digits + 1, count - 1);
+            c += count - 1;
+        }
+        c += sprintf(c, "e%c%02d", exponent < 0 ? '-' : '+', exponent < 0 ? -exponent : exponent);
+    }
+    else if (exponent < 0)
+    {
+        *c++ = '0';
+        *c++ = '.';
+        for (int i = -1; i > exponent; i--)
+            *c++ = '0';
+        memcpy(c, digits, count);
+        c += count;
+    }
+    else if (count <= exponent + 1)
+    {
+        memcpy(c, digits, count);
+        c += count;
+        for (int i = count; i <= exponent; i++)
+            *c++ = '0';
+    }
+    else
+    {
+        memcpy(c, digits, exponent + 1);
+        c += exponent + 1;
+        *c++ = '.';
+        memcpy(c, digits + exponent + 1, count - exponent - 1);
+        c += count - exponent - 1;
+    }
+    return (int)(c - buffer);
+}
+
+static int layoutWhole(char *buffer, uint64_t whole, int power)
+{
+    char digits[24];
+    int count = 0;
+    for (uint64_t rest = whole; rest != 0; rest /= 10)
+        count++;
+    int exponent = count - 1 - power;
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        digits[i] = (char)('0' + whole % 10);
+        whole /= 10;
+    }
+    while (count > 1 && digits[count - 1] == '0')
+        count--;
+    return layout(buffer, digits, count, exponent);
+}
+
+// value is mantissa * 2^-shift. for each power of ten, the nearest whole
+// number to value * 10^power comes out of one exact 128-bit product, and
+// the first one that lies inside value's rounding interval is the shortest.
+// false when that takes more than 19 fraction digits
+static bool shortestDigits(uint64_t mantissa, int shift, bool narrowBelow, uint64_t *whole, int *power)
+{
+    // below 1 the leading digit sits at least this many places after the point
+    int first = shift > 54 ? (int)(((uint64_t)(shift - 54) * 78913) >> 18) : 0;
+    unsigned __int128 one = (unsigned __int128)1 << shift;
+    unsigned __int128 half = one >> 1;
+    bool inclusive = (mantissa & 1) == 0;
+
+    for (int k = first; k <= 19; k++)
+    {
+        uint64_t scale = (uint64_t)exactPowersOfTen[k];
+        unsigned __int128 product = (unsigned __int128)mantissa * scale;
+        uint64_t nearest = (uint64_t)(product >> shift);
+        unsigned __int128 rest = product & (one - 1);
+        if (nearest >= DIGITS_MAX)
+            return false;
+
+        // nearest reads back as value when it is less than half the gap to
+        // the next double away, scaled here by 10^power * 2^shift. the gap
+        // below a power of two is half the one above
+        unsigned __int128 distance;
+        if (rest > half || (rest == half && (nearest & 1)))
+        {
+            nearest++;
+            distance = (one - rest) * 2;
+        }
+        else
+        {
+            distance = rest * (narrowBelow ? 4 : 2);
+        }
+
+        if (nearest != 0 && (distance < scale || (inclusive && distance == scale)))
+        {
+            *whole = nearest;
+            *power = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// value is mantissa * 2^exponent, a whole number of up to 64 bits. from
+// 2^53 on the gap between doubles is 2 or more, so digits can come off the
+// end, rounding what is left, while it stays inside the rounding interval
+static uint64_t shortestWhole(uint64_t mantissa, int exponent, bool narrowBelow, int *power)
+{
+    uint64_t value = mantissa << exponent;
+    unsigned __int128 gap = (unsigned __int128)1 << exponent;
+    bool inclusive = (mantissa & 1) == 0;
+    uint64_t shortest = value;
+    *power = 0;
+
+    // dropping a digit only moves further from value, so the first one
+    // that can't go ends the search
+    for (int k = 1; k <= 19; k++)
+    {
+        uint64_t scale = (uint64_t)exactPowersOfTen[k];
+        uint64_t nearest = value / scale;
+        uint64_t rest = value % scale;
+
+        // twice the distance to value, against the whole gap
+        unsigned __int128 distance;
+        if (rest > scale / 2 || (rest == scale / 2 && (nearest & 1)))
+        {
+            nearest++;
+            distance = (unsigned __int128)(scale - rest) * 2;
+        }
+        else
+        {
+            distance = (unsigned __int128)rest * (narrowBelow ? 4 : 2);
+        }
+        if (distance > gap || (distance == gap && !inclusive))
+            break;
+
+        shortest = nearest;
+        *power = -k;
+    }
+    return shortest;
+}
+
+// the fewest digits printf rounds to that strtod reads back exactly. round
+// trips only get easier with more digits, so the count is searched for
+static int slowFormat(char *buffer, double value)
+{
+    char text[40];
+    int low = 1;
+    int high = 17; // 17 digits always do
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        snprintf(text, sizeof(text), "%.*e", middle - 1, value);
+        if (strtod(text, NULL) == value)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    snprintf(text, sizeof(text), "%.*e", high - 1, value);
+
+    char digits[20];
+    int count = 0;
+    char *c = text;
+    for (; *c != 'e'; c++)
+    {
+        if (*c != '.')
+            digits[count++] = *c;
+    }
+    while (count > 1 && digits[count - 1] == '0')
+        count--;
+    return layout(buffer, digits, count, atoi(c + 1));
+}
+
+int formatNumber(double value, char *buffer)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)((bits >> 52) & 0x7ff);
+    uint64_t fraction = bits & ((1ull << 52) - 1);
+
+    char *c = buffer;
+    if (biased == 0x7ff)
+    {
+        if (fraction != 0)
+        {
+            memcpy(buffer, "nan", 3);
+            return 3;
+        }
+        if (bits >> 63)
+            *c++ = '-';
+        memcpy(c, "inf", 3);
+        return (int)(c - buffer) + 3;
+    }
+    if (bits >> 63)
+    {
+        *c++ = '-';
+        value = -value;
+    }
+    if (value == 0)
+    {
+        *c++ = '0';
+        return (int)(c - buffer);
+    }
+
+    // below 2^53 a whole number's every digit is needed
+    if (value < 9007199254740992.0 && value == (double)(uint64_t)value)
+        return (int)(c - buffer) + layoutWhole(c, (uint64_t)value, 0);
+
+    uint64_t mantissa = biased == 0 ? fraction : fraction | (1ull << 52);
+    int shift = 1075 - (biased == 0 ? 1 : biased);
+    bool narrowBelow = fraction == 0 && biased > 1;
+    uint64_t whole;
+    int power;
+    if (shift <= 0 && shift > -12)
+    {
+        whole = shortestWhole(mantissa, -shift, narrowBelow, &power);
+        return (int)(c - buffer) + layoutWhole(c, whole, power);
+    }
+    if (shift > 0 && shift <= 116 &&
+        shortestDigits(mantissa, shift, narrowBelow, &whole, &power))
+    {
+        return (int)(c - buffer) + layoutWhole(c, whole, power);
+    }
+    return (int)(c - buffer) + slowFormat(c, value);
+}
@@ -1,26 +1,30 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "hash.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
+#include "program.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type *)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type *)allocateObject(vm, sizeof(type), objectType)
 
-static Obj *allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(VM *vm, size_t size, ObjType type)
 {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
     object->type = type;
+    object->frozen = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
-ObjClosure *newClosure(ObjFunction *function)
+ObjClosure *newClosure(VM *vm, ObjFunction *function)
 {
     ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++)
@@ -28,46 +32,80 @@ ObjClosure *newClosure(ObjFunction *function)
         upvalues[i] = NULL;
     }
 
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-ObjFunction *newFunction()
+ObjFunction *newFunction(VM *vm)
 {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    // unknown until the compiler or the cache measures it
+    function->stackSize = STACK_MAX;
     function->name = NULL;
+    function->lazySource = NULL;
+    function->lazyLine = 0;
+    function->upvalueNames = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative *newNative(NativeFn function, const char *name)
+ObjNative *newNative(VM *vm, NativeFn function, const char *name)
 {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     native->name = name;
     return native;
 }
 
-uint32_t hashString(const char *key, int length)
+// 0 is kept to mean a runtime string hasn't been hashed yet
+static uint32_t hashChars(const char *chars, int length)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
+    uint32_t hash = hashString(chars, length);
+    return hash != 0 ? hash : 1;
+}
+
+uint32_t stringHash(ObjString *string)
+{
+    if (string->hash == 0)
+        string->hash = hashChars(string->chars, string->length);
+    return string->hash;
+}
+
+bool stringsEqual(ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+    if ((a->interned && b->interned) || a->length != b->length)
+        return false;
+    if (a->hash != 0 && b->hash != 0 && a->hash != b->hash)
+        return false;
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// a program's strings come first, so every vm sharing it interns each of
+// its names and constants to the same object
+static ObjString *findInterned(VM *vm, const char *chars, int length, uint32_t hash)
+{
+    if (vm->program != NULL)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        ObjString *shared = internSetFind(&vm->program->strings, chars, length, hash);
+        if (shared != NULL)
+            return shared;
     }
-    return hash;
+    return internSetFind(&vm->strings, chars, length, hash);
 }
 
-ObjString *internString(ObjString *string)
+ObjString *internString(VM *vm, ObjString *string)
 {
-    ObjString *interned = tableFindString(&vm.strings, string->chars,
-                                          string->length, string->hash);
+    if (string->interned)
+        return string;
+
+    ObjString *interned = findInterned(vm, string->chars, string->length, stringHash(string));
 
     if (interned != NULL)
     {
@@ -75,88 +113,290 @@ ObjString *internString(ObjString *string)
     }
     else
     {
-        tableSet(&vm.strings, string, NIL_VAL);
+        string->interned = true;
+        internSetAdd(&vm->strings, string);
         return string;
     }
 }
 
-ObjString *makeString(int length)
+static void initString(ObjString *string, int length)
 {
-    ObjString *string = (ObjString *)allocateObject(
-        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
+    string->hash = 0;
+    string->interned = false;
+}
+
+ObjString *makeString(VM *vm, int length)
+{
+    ObjString *string = (ObjString *)allocateObject(
+        vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+    initString(string, length);
     return string;
 }
 
-ObjString *copyString(const char *chars, int length)
+ObjString *copyString(VM *vm, const char *chars, int length)
 {
-    ObjString *interned = tableFindString(&vm.strings, chars,
-                                          length, hashString(chars, length));
+    uint32_t hash = hashChars(chars, length);
+    ObjString *interned = findInterned(vm, chars, length, hash);
 
     if (interned != NULL)
     {
         return interned;
     }
-    ObjString *string = makeString(length);
+    ObjString *string = makeString(vm, length);
+
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    string->hash = hash;
+    string->interned = true;
+    internSetAdd(&vm->strings, string);
+    return string;
+}
+
+// a string made at runtime, kept in the value when it is short enough
+Value copyText(VM *vm, const char *chars, int length)
+{
+    Value value;
+    if (makeSmallString(chars, length, &value))
+        return value;
 
+    ObjString *string = makeString(vm, length);
     memcpy(string->chars, chars, length);
     string->chars[length] = '\0';
-    string->hash = hashString(chars, length);
-    tableSet(&vm.strings, string, NIL_VAL);
+    return OBJ_VAL(string);
+}
+
+// ropes only hold heap strings, so a small operand gets its own copy
+static Obj *ropeNode(VM *vm, Value value)
+{
+    if (IS_SMALL_STRING(value))
+    {
+        ObjString *string = makeString(vm, smallLength(value));
+        memcpy(string->chars, value.as.small, string->length);
+        string->chars[string->length] = '\0';
+        return (Obj *)string;
+    }
+    return AS_OBJ(value);
+}
+
+ObjRope *newRope(VM *vm, Value leftValue, Value rightValue, int length)
+{
+    Obj *left = ropeNode(vm, leftValue);
+    Obj *right = ropeNode(vm, rightValue);
+
+    // a flattened rope is as good as its string and keeps the tree shallow
+    if (left->type == OBJ_ROPE && ((ObjRope *)left)->flat != NULL)
+        left = (Obj *)((ObjRope *)left)->flat;
+    if (right->type == OBJ_ROPE && ((ObjRope *)right)->flat != NULL)
+        right = (Obj *)((ObjRope *)right)->flat;
+
+    ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+ObjString *flattenRope(ObjRope *rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    // the flat copy belongs to the rope and is freed along with it, which
+    // lets any string be read without the vm that made it
+    ObjString *string = (ObjString *)reallocate(
+        NULL, 0, sizeof(ObjString) + rope->length + 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.next = NULL;
+    initString(string, rope->length);
+    char *end = string->chars + rope->length;
+
+    // copies back to front, so a rope that grew by appending in a loop
+    // never has more than one left branch waiting
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+    Obj **pending = NULL;
+    Obj *node = (Obj *)rope;
+    for (;;)
+    {
+        if (node->type == OBJ_ROPE && ((ObjRope *)node)->flat != NULL)
+            node = (Obj *)((ObjRope *)node)->flat;
+
+        if (node->type == OBJ_ROPE)
+        {
+            if (pendingCount == pendingCapacity)
+            {
+                int oldCapacity = pendingCapacity;
+                pendingCapacity = GROW_CAPACITY(oldCapacity);
+                pending = GROW_ARRAY(Obj *, pending, oldCapacity, pendingCapacity);
+            }
+            pending[pendingCount++] = ((ObjRope *)node)->left;
+            node = ((ObjRope *)node)->right;
+            continue;
+        }
+
+        if (node->type == OBJ_SLICE)
+        {
+            ObjSlice *piece = (ObjSlice *)node;
+            end -= piece->length;
+            memcpy(end, piece->parent->chars + piece->start, piece->length);
+        }
+        else
+        {
+            ObjString *piece = (ObjString *)node;
+            end -= piece->length;
+            memcpy(end, piece->chars, piece->length);
+        }
+        if (pendingCount == 0)
+            break;
+        node = pending[--pendingCount];
+    }
+    FREE_ARRAY(Obj *, pending, pendingCapacity);
+
+    string->chars[rope->length] = '\0';
+    rope->flat = string;
     return string;
 }
 
-ObjUpvalue *newUpvalue(Value *slot)
+// text is never a small string, which is too short to be worth slicing
+ObjSlice *newSlice(VM *vm, Value text, int start, int length)
+{
+    // always point at flat storage, never at another slice
+    ObjString *parent;
+    if (IS_SLICE(text))
+    {
+        start += AS_SLICE(text)->start;
+        parent = AS_SLICE(text)->parent;
+    }
+    else if (IS_ROPE(text))
+    {
+        parent = flattenRope(AS_ROPE(text));
+    }
+    else
+    {
+        parent = AS_STRING(text);
+    }
+
+    ObjSlice *slice = ALLOCATE_OBJ(vm, ObjSlice, OBJ_SLICE);
+    slice->start = start;
+    slice->length = length;
+    slice->parent = parent;
+    return slice;
+}
+
+ObjUpvalue *newUpvalue(VM *vm, Value *slot)
 {
-    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
     return upvalue;
 }
 
-static void printFunction(ObjFunction *function)
+// the closure waits in the first slot of the new stack until the first resume
+ObjCoroutine *newCoroutine(VM *vm, ObjClosure *closure)
+{
+    ObjCoroutine *coroutine = ALLOCATE_OBJ(vm, ObjCoroutine, OBJ_COROUTINE);
+    coroutine->state = COROUTINE_SUSPENDED;
+    coroutine->started = false;
+    coroutine->pulled = false;
+    coroutine->resumer = NULL;
+
+    Fiber *fiber = &coroutine->fiber;
+    fiber->frameCapacity = FIBER_FRAMES_MIN;
+    fiber->stackCapacity = FIBER_STACK_MIN;
+    fiber->frames = ALLOCATE(CallFrame, fiber->frameCapacity);
+    fiber->frameCount = 0;
+    fiber->stack = ALLOCATE(Value, fiber->stackCapacity);
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stackTop = fiber->stack + 1;
+    fiber->openUpvalues = NULL;
+    return coroutine;
+}
+
+ObjChannel *newChannel(VM *vm, Channel *channel)
+{
+    ObjChannel *handle = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    return handle;
+}
+
+ObjIsolate *newIsolate(VM *vm, Isolate *isolate)
+{
+    ObjIsolate *handle = ALLOCATE_OBJ(vm, ObjIsolate, OBJ_ISOLATE);
+    handle->isolate = isolate;
+    return handle;
+}
+
+static void printFunction(FILE *out, ObjFunction *function)
 {
     if (function->name == NULL)
     {
-        printf("<script>");
+        fprintf(out, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(out, "<fn %s>", function->name->chars);
 }
 
-void printObject(Value value)
+void printObject(FILE *out, Value value)
 {
     switch (OBJ_TYPE(value))
     {
     case OBJ_CLOSURE:
     {
-        printFunction(AS_CLOSURE(value)->function);
+        printFunction(out, AS_CLOSURE(value)->function);
         break;
     }
     case OBJ_NATIVE:
     {
-        printf("<native fn %s>", AS_NATIVE_OBJ(value)->name);
+        fprintf(out, "<native fn %s>", AS_NATIVE_OBJ(value)->name);
         break;
     }
     case OBJ_FUNCTION:
     {
-        printFunction(AS_FUNCTION(value));
+        printFunction(out, AS_FUNCTION(value));
         break;
     }
     case OBJ_STRING:
     {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("\"%s\"", AS_CSTRING(value));
+        fprintf(out, "\"%s\"", AS_CSTRING(value));
+#endif
+#ifndef DEBUG_TRACE_EXECUTION
+        fwrite(AS_CSTRING(value), 1, (size_t)AS_STRING(value)->length, out);
+#endif
+        break;
+    }
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+    {
+#ifdef DEBUG_TRACE_EXECUTION
+        fprintf(out, "\"%.*s\"", textLength(value), textChars(&value));
 #endif
 #ifndef DEBUG_TRACE_EXECUTION
-        printf("%s", AS_CSTRING(value));
+        fwrite(textChars(&value), 1, (size_t)textLength(value), out);
 #endif
         break;
     }
+    case OBJ_COROUTINE:
+    {
+        fprintf(out, "<coroutine>");
+        break;
+    }
+    case OBJ_CHANNEL:
+    {
+        fprintf(out, "<channel>");
+        break;
+    }
+    case OBJ_ISOLATE:
+    {
+        fprintf(out, "<isolate>");
+        break;
+    }
     case OBJ_UPVALUE:
     {
-        printf("upvalue");
+        fprintf(out, "upvalue");
         break;
     }
     }
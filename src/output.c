@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+// the main script prints through one stream over stdout. on a tty it is line
+// buffered so output shows up as it is printed. otherwise it fills blocks
+// of OUTPUT_BUFFER_SIZE, and either stdio writes them itself or, with
+// async, a writer thread does while the script keeps running
+
+typedef struct Block
+{
+    struct Block *next;
+    size_t length;
+    char chars[];
+} Block;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    Block *head;
+    Block *tail;
+    int queued;
+    bool closing;
+    bool failed;
+} Writer;
+
+static Writer writer;
+static FILE *output = NULL;
+
+static bool writeAll(int fd, const char *chars, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, chars, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        chars += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+static void *runWriter(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&writer.lock);
+    for (;;)
+    {
+        while (writer.head == NULL && !writer.closing)
+            pthread_cond_wait(&writer.changed, &writer.lock);
+        Block *block = writer.head;
+        if (block == NULL)
+            break;
+
+        // the block stays queued while it is written so a full queue keeps
+        // counting it
+        pthread_mutex_unlock(&writer.lock);
+        bool ok = writeAll(STDOUT_FILENO, block->chars, block->length);
+        pthread_mutex_lock(&writer.lock);
+
+        writer.head = block->next;
+        if (writer.head == NULL)
+            writer.tail = NULL;
+        writer.queued--;
+        writer.failed |= !ok;
+        free(block);
+        pthread_cond_broadcast(&writer.changed);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return NULL;
+}
+
+// stdio hands over each full block, and whatever is left on fflush. a
+// flush waits until everything is written, so fflush() still means the
+// output is out before an error or a prompt follows it
+static ssize_t queueBlock(void *cookie, const char *chars, size_t length)
+{
+    (void)cookie;
+    Block *block = malloc(sizeof(Block) + length);
+    if (block == NULL)
+        return -1;
+    memcpy(block->chars, chars, length);
+    block->length = length;
+    block->next = NULL;
+
+    pthread_mutex_lock(&writer.lock);
+    while (writer.queued >= OUTPUT_QUEUE_MAX && !writer.failed)
+        pthread_cond_wait(&writer.changed, &writer.lock);
+    bool failed = writer.failed;
+    if (!failed)
+    {
+        if (writer.tail == NULL)
+            writer.head = block;
+        else
+            writer.tail->next = block;
+        writer.tail = block;
+        writer.queued++;
+        pthread_cond_broadcast(&writer.changed);
+        while (length < OUTPUT_BUFFER_SIZE && writer.head != NULL && !writer.failed)
+            pthread_cond_wait(&writer.changed, &writer.lock);
+    }
+    pthread_mutex_unlock(&writer.lock);
+
+    if (failed)
+    {
+        free(block);
+        return -1;
+    }
+    return (ssize_t)length;
+}
+
+// waits for the writer to drain the queue and finish
+static int closeWriter(void *cookie)
+{
+    (void)cookie;
+    pthread_mutex_lock(&writer.lock);
+    writer.closing = true;
+    pthread_cond_broadcast(&writer.changed);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+    return writer.failed ? EOF : 0;
+}
+
+static FILE *openAsync()
+{
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.changed, NULL);
+    writer.head = writer.tail = NULL;
+    writer.queued = 0;
+    writer.closing = writer.failed = false;
+
+    cookie_io_functions_t functions = {.write = queueBlock, .close = closeWriter};
+    FILE *stream = fopencookie(NULL, "w", functions);
+    if (stream == NULL)
+        return NULL;
+    if (pthread_create(&writer.thread, NULL, runWriter, NULL) != 0)
+    {
+        // nothing is queued until the first flush, so this closes at once
+        writer.closing = true;
+        fclose(stream);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    return stream;
+}
+
+// returns the stream to print to, stdout itself unless async is asked for
+// and stdout isn't a tty. output is flushed at exit either way
+FILE *openOutput(bool async)
+{
+    if (output != NULL)
+        return output;
+
+    if (isatty(STDOUT_FILENO))
+    {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        output = stdout;
+    }
+    else
+    {
+        output = async ? openAsync() : NULL;
+        if (output == NULL)
+        {
+            setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+            output = stdout;
+        }
+    }
+    atexit(closeOutput);
+    return output;
+}
+
+// stdio's own flush at exit comes after the atexit handlers, too late to
+// hand the last block to the writer thread and wait for it
+void closeOutput()
+{
+    if (output == NULL)
+        return;
+    if (output == stdout)
+        fflush(stdout);
+    else
+        fclose(output);
+    output = NULL;
+}
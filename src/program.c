@@ -0,0 +1,126 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "program.h"
+#include "vm.h"
+
+// the program is built in a vm of its own that then hands over everything
+// it allocated. bodies are never skipped, a lazy compile would write into
+// functions other threads are running
+static bool freeze(Program *program, VM *scratch, ObjFunction *script)
+{
+    if (script != NULL)
+    {
+        for (Obj *object = scratch->objects; object != NULL; object = object->next)
+        {
+            object->frozen = true;
+        }
+        program->script = script;
+        program->objects = scratch->objects;
+        program->strings = scratch->strings;
+        program->sealed = NULL;
+        program->sealedSize = 0;
+
+        scratch->objects = NULL;
+        initInternSet(&scratch->strings);
+    }
+
+    freeVM(scratch);
+    FREE(VM, scratch);
+    return script != NULL;
+}
+
+bool compileProgram(Program *program, const char *source)
+{
+    VM *scratch = ALLOCATE(VM, 1);
+    initVM(scratch, NULL);
+    return freeze(program, scratch, compile(scratch, source, false));
+}
+
+// the cache's chunks are borrowed, so image has to outlive the program
+bool loadProgram(Program *program, const char *path, uint64_t sourceHash, size_t sourceLength,
+                 CacheImage *image)
+{
+    VM *scratch = ALLOCATE(VM, 1);
+    initVM(scratch, NULL);
+    return freeze(program, scratch, loadCache(scratch, path, sourceHash, sourceLength, image));
+}
+
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+static size_t chunkSize(Chunk *chunk)
+{
+    return ALIGN8(chunk->count) + ALIGN8(sizeof(LineStart) * chunk->lineCount) +
+           sizeof(Value) * chunk->constants.count;
+}
+
+static void *moveBytes(uint8_t **next, void *bytes, size_t size)
+{
+    void *moved = *next;
+    if (size > 0)
+        memcpy(moved, bytes, size);
+    *next += ALIGN8(size);
+    return moved;
+}
+
+// moves the bytecode, line tables and constant pools of every function onto
+// pages of their own and makes them read-only. processes forked afterwards
+// share those pages for good, since a write faults instead of copying one.
+// the chunks are left without capacity, borrowed like a cache's
+bool sealProgram(Program *program)
+{
+    size_t size = 0;
+    for (Obj *object = program->objects; object != NULL; object = object->next)
+    {
+        if (object->type == OBJ_FUNCTION)
+            size += chunkSize(&((ObjFunction *)object)->chunk);
+    }
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size = (size + pageSize) & ~(pageSize - 1);
+
+    uint8_t *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return false;
+
+    uint8_t *next = region;
+    for (Obj *object = program->objects; object != NULL; object = object->next)
+    {
+        if (object->type != OBJ_FUNCTION)
+            continue;
+        Chunk *chunk = &((ObjFunction *)object)->chunk;
+        Chunk sealed = *chunk;
+        sealed.code = moveBytes(&next, chunk->code, chunk->count);
+        sealed.lines = moveBytes(&next, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+        sealed.constants.values = moveBytes(&next, chunk->constants.values,
+                                            sizeof(Value) * chunk->constants.count);
+        freeChunk(chunk);
+        sealed.capacity = 0;
+        sealed.lineCapacity = 0;
+        sealed.constants.capacity = 0;
+        *chunk = sealed;
+    }
+
+    if (mprotect(region, size, PROT_READ) == -1)
+    {
+        // the chunks have moved already, they just stay writable
+        perror("mprotect");
+    }
+    program->sealed = region;
+    program->sealedSize = size;
+    return true;
+}
+
+void freeProgram(Program *program)
+{
+    freeInternSet(&program->strings);
+    freeObjects(program->objects);
+    if (program->sealed != NULL)
+        munmap(program->sealed, program->sealedSize);
+    program->script = NULL;
+    program->objects = NULL;
+    program->sealed = NULL;
+    program->sealedSize = 0;
+}
@@ -4,284 +4,401 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct
-{
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-void initScanner(const char *source)
+void initScanner(Scanner *scanner, const char *source, int line)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = line;
 }
 
+enum
+{
+    CHAR_ALPHA = 1 << 0,
+    CHAR_DIGIT = 1 << 1,
+    CHAR_SPACE = 1 << 2,
+};
+
+static const uint8_t charClass[256] = {
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+    ['0' ... '9'] = CHAR_DIGIT,
+    [' '] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,
+};
+
 static bool isAlpha(char c)
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    return charClass[(uint8_t)c] & CHAR_ALPHA;
 }
 
 static bool isDigit(char c)
 {
-    return c >= '0' && c <= '9';
+    return charClass[(uint8_t)c] & CHAR_DIGIT;
 }
 
-static bool isAtEnd()
+static bool isAlphaNumeric(char c)
 {
-    return *scanner.current == '\0';
+    return charClass[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT);
 }
 
-static char advance()
+#ifdef __SSE2__
+// the block helpers below load 16 byte aligned blocks, an aligned load never
+// crosses a page so reading past the terminator stays inside mapped memory
+
+// bitmask of bytes in the block equal to c
+static inline unsigned blockMatch(__m128i block, char c)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+static inline const char *alignBlock(const char *p, unsigned *before)
+{
+    uintptr_t misalign = (uintptr_t)p & 15;
+    *before = (1u << misalign) - 1;
+    return p - misalign;
+}
+#endif
+
+// advances past a run of whitespace, counting newlines
+static void skipSpaces(Scanner *scanner)
+{
+#ifdef __SSE2__
+    // most runs are a separator or two, only go wide for indentation
+    for (int i = 0; i < 4; i++)
+    {
+        char c = *scanner->current;
+        if (!(charClass[(uint8_t)c] & CHAR_SPACE))
+            return;
+        if (c == '\n')
+            scanner->line++;
+        scanner->current++;
+    }
+
+    unsigned before;
+    const char *block = alignBlock(scanner->current, &before);
+    for (;;)
+    {
+        __m128i bytes = _mm_load_si128((const __m128i *)block);
+        unsigned newlines = blockMatch(bytes, '\n') & ~before;
+        unsigned spaces = blockMatch(bytes, ' ') | blockMatch(bytes, '\t') |
+                          blockMatch(bytes, '\r') | newlines | before;
+        if (spaces != 0xffff)
+        {
+            int stop = __builtin_ctz(~spaces);
+            scanner->line += __builtin_popcount(newlines & ((1u << stop) - 1));
+            scanner->current = block + stop;
+            return;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        block += 16;
+        before = 0;
+    }
+#else
+    while (charClass[(uint8_t)*scanner->current] & CHAR_SPACE)
+    {
+        if (*scanner->current == '\n')
+            scanner->line++;
+        scanner->current++;
+    }
+#endif
 }
 
-static char peek()
+// advances to the newline or terminator ending a line comment
+static void skipComment(Scanner *scanner)
 {
-    return *scanner.current;
+#ifdef __SSE2__
+    // the two slashes are known, the block starts after them
+    scanner->current += 2;
+    unsigned before;
+    const char *block = alignBlock(scanner->current, &before);
+    for (;;)
+    {
+        __m128i bytes = _mm_load_si128((const __m128i *)block);
+        unsigned stops = (blockMatch(bytes, '\n') | blockMatch(bytes, '\0')) & ~before;
+        if (stops != 0)
+        {
+            scanner->current = block + __builtin_ctz(stops);
+            return;
+        }
+        block += 16;
+        before = 0;
+    }
+#else
+    while (*scanner->current != '\n' && *scanner->current != '\0')
+        scanner->current++;
+#endif
 }
 
-static char peekNext()
+// advances to the closing quote or terminator of a string, counting newlines
+static void skipStringBody(Scanner *scanner)
 {
-    if (isAtEnd())
+#ifdef __SSE2__
+    // empty and one character strings, "" and "!", end before a block
+    // load and its masks would pay for themselves
+    for (int i = 0; i < 2; i++)
+    {
+        char c = *scanner->current;
+        if (c == '"' || c == '\0')
+            return;
+        if (c == '\n')
+            scanner->line++;
+        scanner->current++;
+    }
+
+    unsigned before;
+    const char *block = alignBlock(scanner->current, &before);
+    for (;;)
+    {
+        __m128i bytes = _mm_load_si128((const __m128i *)block);
+        unsigned newlines = blockMatch(bytes, '\n') & ~before;
+        unsigned stops = (blockMatch(bytes, '"') | blockMatch(bytes, '\0')) & ~before;
+        if (stops != 0)
+        {
+            int stop = __builtin_ctz(stops);
+            scanner->line += __builtin_popcount(newlines & ((1u << stop) - 1));
+            scanner->current = block + stop;
+            return;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        block += 16;
+        before = 0;
+    }
+#else
+    while (*scanner->current != '"' && *scanner->current != '\0')
+    {
+        if (*scanner->current == '\n')
+            scanner->line++;
+        scanner->current++;
+    }
+#endif
+}
+
+static bool isAtEnd(Scanner *scanner)
+{
+    return *scanner->current == '\0';
+}
+
+static char advance(Scanner *scanner)
+{
+    scanner->current++;
+    return scanner->current[-1];
+}
+
+static char peek(Scanner *scanner)
+{
+    return *scanner->current;
+}
+
+static char peekNext(Scanner *scanner)
+{
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return false;
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner *scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char *message)
+static Token errorToken(Scanner *scanner, const char *message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = peek();
-        switch (c)
+        char c = peek(scanner);
+        if (charClass[(uint8_t)c] & CHAR_SPACE)
+        {
+            skipSpaces(scanner);
+        }
+        else if (c == '/' && peekNext(scanner) == '/')
+        {
+            skipComment(scanner);
+        }
+        else
         {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance();
-            break;
-        case '\n':
-            scanner.line++;
-            advance();
-            break;
-        case '/':
-            if (peekNext() == '/')
-            {
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
-            }
-            else
-            {
-                return;
-            }
-            break;
-        default:
             return;
         }
     }
 }
 
-static TokenType checkKeyWord(int start, int length, const char *rest, TokenType type)
+typedef struct
 {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
-    {
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
-}
-
-static TokenType identifierType()
+    const char *name;
+    int length;
+    TokenType type;
+} Keyword;
+
+// perfect hash over the first two characters and the length of every keyword
+#define KEYWORD_HASH(first, second, length) \
+    (((uint8_t)(first) + (uint8_t)(second)*18u + (unsigned)(length)*7u) & 31u)
+
+static const Keyword keywords[32] = {
+    [0] = {"this", 4, TOKEN_THIS},
+    [1] = {"or", 2, TOKEN_OR},
+    [3] = {"if", 2, TOKEN_IF},
+    [5] = {"nil", 3, TOKEN_NIL},
+    [9] = {"for", 3, TOKEN_FOR},
+    [10] = {"while", 5, TOKEN_WHILE},
+    [16] = {"super", 5, TOKEN_SUPER},
+    [18] = {"and", 3, TOKEN_AND},
+    [20] = {"true", 4, TOKEN_TRUE},
+    [21] = {"fun", 3, TOKEN_FUN},
+    [22] = {"return", 6, TOKEN_RETURN},
+    [23] = {"print", 5, TOKEN_PRINT},
+    [25] = {"else", 4, TOKEN_ELSE},
+    [27] = {"false", 5, TOKEN_FALSE},
+    [29] = {"var", 3, TOKEN_VAR},
+    [30] = {"class", 5, TOKEN_CLASS},
+};
+
+static TokenType identifierType(Scanner *scanner)
 {
-    switch (scanner.start[0])
-    {
-    case 'a':
-        return checkKeyWord(1, 2, "nd", TOKEN_AND);
-    case 'c':
-        return checkKeyWord(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-        return checkKeyWord(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-    {
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'a':
-                return checkKeyWord(2, 3, "lse", TOKEN_FALSE);
-            case 'o':
-                return checkKeyWord(2, 1, "r", TOKEN_FOR);
-            case 'u':
-                return checkKeyWord(2, 1, "n", TOKEN_FUN);
-            }
-        }
-        break;
-    }
+    int length = (int)(scanner->current - scanner->start);
+    if (length < 2 || length > 6)
+        return TOKEN_IDENTIFIER;
 
-    case 'i':
-        return checkKeyWord(1, 1, "f", TOKEN_IF);
-    case 'n':
-        return checkKeyWord(1, 2, "il", TOKEN_NIL);
-    case 'o':
-        return checkKeyWord(1, 1, "r", TOKEN_OR);
-    case 'p':
-        return checkKeyWord(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-        return checkKeyWord(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-        return checkKeyWord(1, 4, "uper", TOKEN_SUPER);
-    case 't':
+    const Keyword *keyword = &keywords[KEYWORD_HASH(scanner->start[0], scanner->start[1], length)];
+    if (keyword->length == length &&
+        memcmp(scanner->start, keyword->name, length) == 0)
     {
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'h':
-                return checkKeyWord(2, 2, "is", TOKEN_THIS);
-            case 'r':
-                return checkKeyWord(2, 2, "ue", TOKEN_TRUE);
-            }
-        }
-        break;
+        return keyword->type;
     }
-    case 'v':
-        return checkKeyWord(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-        return checkKeyWord(1, 4, "hile", TOKEN_WHILE);
-    }
-
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
-    return makeToken(identifierType());
+    while (isAlphaNumeric(peek(scanner)))
+        advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number()
+static Token number(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance();
+    while (isDigit(peek(scanner)))
+        advance(scanner);
 
-    if (peek() == '.' && isDigit(peekNext()))
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek()))
-            advance();
+        while (isDigit(peek(scanner)))
+            advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-    while (peek() != '"' && !isAtEnd())
-    {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
-    }
+    skipStringBody(scanner);
 
-    if (isAtEnd())
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
     // Closing ""
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhitespace();
-    scanner.start = scanner.current;
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (isAlpha(c))
-        return identifier();
+        return identifier(scanner);
 
     if (isDigit(c))
-        return number();
+        return number(scanner);
 
     switch (c)
     {
     case '(':
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return makeToken(TOKEN_LEFT_BRACE);
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return makeToken(TOKEN_RIGHT_BRACE);
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return makeToken(TOKEN_SEMICOLON);
+        return makeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return makeToken(TOKEN_COMMA);
+        return makeToken(scanner, TOKEN_COMMA);
     case '.':
-        return makeToken(TOKEN_DOT);
+        return makeToken(scanner, TOKEN_DOT);
     case '-':
-        return makeToken(TOKEN_MINUS);
+        return makeToken(scanner, TOKEN_MINUS);
     case '+':
-        return makeToken(TOKEN_PLUS);
+        return makeToken(scanner, TOKEN_PLUS);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, TOKEN_SLASH);
     case '*':
-        return makeToken(TOKEN_STAR);
+        return makeToken(scanner, TOKEN_STAR);
+    case '%':
+        return makeToken(scanner, TOKEN_PERCENT);
+    case '&':
+        return makeToken(scanner, TOKEN_AMPERSAND);
+    case '|':
+        return makeToken(scanner, TOKEN_PIPE);
+    case '^':
+        return makeToken(scanner, TOKEN_CARET);
     case '!':
-        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 
     case '=':
-        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 
     case '<':
-        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        if (match(scanner, '<'))
+            return makeToken(scanner, TOKEN_LESS_LESS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 
     case '>':
-        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        if (match(scanner, '>'))
+            return makeToken(scanner, TOKEN_GREATER_GREATER);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
@@ -0,0 +1,298 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "number.h"
+#include "serve.h"
+#include "vm.h"
+
+// a client sends one request and closes its end. the first line says what
+// to do, anything after it is the script to run:
+//
+//     run\n<source>
+//     call <global> [argument...]\n
+//
+// arguments that read as numbers are passed as numbers, anything else as a
+// string. the reply is what the code prints and any error it reports, as it
+// is printed, then a last line "exit <status>" with the status running it
+// from a file would have exited with. a call's result is printed before that.
+// with --fuel each request gets that budget, and the isolates it spawns
+// each get it again
+
+// the largest request read, scripts longer than this are refused
+#define REQUEST_MAX (16 * 1024 * 1024)
+
+// how long a client has to send its whole request, and how long a write to
+// one that stopped reading may block, before the worker gives up on it
+#define REQUEST_TIMEOUT_MS 10000
+
+typedef struct
+{
+    int listener;
+    Program *prelude;
+    int64_t fuel; // each request's budget, FUEL_UNLIMITED when not metered
+} Server;
+
+// a warm vm has the prelude's globals defined and nothing else
+static void warmVM(VM *vm, Program *prelude)
+{
+    initVM(vm, prelude);
+    if (interpretFunction(vm, prelude->script) != INTERPRET_OK)
+    {
+        fprintf(stderr, "The prelude failed.\n");
+        exit(70);
+    }
+}
+
+static int64_t milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// NULL when the client sent nothing or too much, or didn't finish in time
+static char *readRequest(int fd)
+{
+    int64_t deadline = milliseconds() + REQUEST_TIMEOUT_MS;
+    size_t capacity = 4096;
+    size_t count = 0;
+    char *request = ALLOCATE(char, capacity);
+    for (;;)
+    {
+        if (count + 1 == capacity)
+        {
+            if (capacity >= REQUEST_MAX)
+                break;
+            request = GROW_ARRAY(char, request, capacity, capacity * 2);
+            capacity *= 2;
+        }
+        int64_t left = deadline - milliseconds();
+        struct pollfd ready = {fd, POLLIN, 0};
+        int polled = left > 0 ? poll(&ready, 1, (int)left) : 0;
+        if (polled < 0 && errno == EINTR)
+            continue;
+        if (polled <= 0)
+            break;
+        ssize_t bytes = read(fd, request + count, capacity - count - 1);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+        {
+            request[count] = '\0';
+            if (bytes == 0 && count > 0)
+                return request;
+            break;
+        }
+        count += (size_t)bytes;
+    }
+    FREE_ARRAY(char, request, capacity);
+    return NULL;
+}
+
+static bool isNumber(const char *chars, int length)
+{
+    int i = 0;
+    while (i < length && chars[i] >= '0' && chars[i] <= '9')
+        i++;
+    if (i == 0)
+        return false;
+    if (i < length && chars[i] == '.')
+    {
+        int fraction = ++i;
+        while (i < length && chars[i] >= '0' && chars[i] <= '9')
+            i++;
+        if (i == fraction)
+            return false;
+    }
+    return i == length;
+}
+
+// the same literals a script could write, with an optional minus sign
+static Value parseArgument(VM *vm, const char *chars)
+{
+    int length = (int)strlen(chars);
+    bool negative = chars[0] == '-';
+    if (isNumber(chars + negative, length - negative))
+    {
+        int64_t integer;
+        if (parseInteger(chars + negative, length - negative, &integer))
+            return INT_VAL(negative ? -integer : integer);
+        double number = parseNumber(chars + negative, length - negative);
+        return NUMBER_VAL(negative ? -number : number);
+    }
+    return copyText(vm, chars, length);
+}
+
+static InterpretResult callGlobal(VM *vm, char *line)
+{
+    char *rest;
+    char *name = strtok_r(line, " \t", &rest);
+    Value callee;
+    if (name == NULL || !tableGet(&vm->globals, copyString(vm, name, (int)strlen(name)), &callee))
+    {
+        fprintf(vm->err, "Undefined variable '%s'.\n", name == NULL ? "" : name);
+        return INTERPERT_RUNTIME_ERROR;
+    }
+
+    push(vm, callee);
+    int argCount = 0;
+    for (char *argument; (argument = strtok_r(NULL, " \t", &rest)) != NULL; argCount++)
+    {
+        if (argCount == UINT8_MAX)
+        {
+            fprintf(vm->err, "Can't have more than 255 arguments.\n");
+            return INTERPERT_RUNTIME_ERROR;
+        }
+        push(vm, parseArgument(vm, argument));
+    }
+
+    Value result;
+    InterpretResult status = interpretCall(vm, argCount, &result);
+    if (status == INTERPRET_OK)
+    {
+        printValue(vm->out, result);
+        fputc('\n', vm->out);
+    }
+    return status;
+}
+
+static InterpretResult handleRequest(VM *vm, char *request)
+{
+    char *body = strchr(request, '\n');
+    if (body != NULL)
+        *body++ = '\0';
+    else
+        body = request + strlen(request);
+
+    if (strcmp(request, "run") == 0)
+    {
+        ObjFunction *function = compile(vm, body, false);
+        return function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(vm, function);
+    }
+    if (strncmp(request, "call ", 5) == 0)
+        return callGlobal(vm, request + 5);
+
+    fprintf(vm->err, "Unknown request '%s'.\n", request);
+    return INTERPRET_COMPILE_ERROR;
+}
+
+// the vm is warm when a connection arrives. it is thrown away and warmed
+// again once the reply is out, so no request sees what an earlier one did
+// and the client doesn't wait for the prelude
+static void serveConnection(VM *vm, Server *server, int fd)
+{
+    struct timeval timeout = {REQUEST_TIMEOUT_MS / 1000, REQUEST_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    FILE *reply = fdopen(fd, "w");
+    if (reply == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    char *request = readRequest(fd);
+    int status = 74;
+    if (request != NULL)
+    {
+        vm->out = reply;
+        vm->err = reply;
+        vm->fuel = server->fuel;
+        vm->isolateFuel = server->fuel;
+        InterpretResult result = handleRequest(vm, request);
+        if (result == INTERPRET_OUT_OF_FUEL)
+            fprintf(reply, "Out of fuel after %" PRId64 " loop iterations and calls.\n", server->fuel);
+        status = exitStatus(result);
+        FREE_ARRAY(char, request, strlen(request) + 1);
+    }
+    else
+    {
+        fprintf(reply, "Could not read the request.\n");
+    }
+
+    // isolates the request spawned are joined here, and may still print
+    freeVM(vm);
+    fprintf(reply, "exit %d\n", status);
+    fclose(reply);
+    warmVM(vm, server->prelude);
+}
+
+static void *runServer(void *argument)
+{
+    Server *server = (Server *)argument;
+    VM *vm = ALLOCATE(VM, 1);
+    warmVM(vm, server->prelude);
+
+    for (;;)
+    {
+        int fd = accept(server->listener, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            exit(74);
+        }
+        serveConnection(vm, server, fd);
+    }
+    return NULL;
+}
+
+// listens on a unix socket at path and never returns. each worker thread
+// accepts connections itself with a vm kept warm on the prelude, which is
+// compiled once and shared by all of them. fuel is each request's budget, 0
+// for none
+void serve(const char *path, Program *prelude, int workers, int64_t fuel)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        exit(64);
+    }
+    strcpy(address.sun_path, path);
+
+    // a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listener, SOMAXCONN) == -1)
+    {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", path, strerror(errno));
+        exit(74);
+    }
+
+    // a client that hangs up early mustn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server = {listener, prelude, fuel > 0 ? fuel : FUEL_UNLIMITED};
+    for (int i = 1; i < workers; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runServer, &server) != 0)
+        {
+            fprintf(stderr, "Could not start a server thread.\n");
+            exit(74);
+        }
+        pthread_detach(thread);
+    }
+    runServer(&server);
+}
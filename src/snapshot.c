@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// a snapshot image is the header followed by copies of every object reachable
+// from the globals, laid out exactly as in memory but with each pointer
+// replaced by its offset in the image. the relocation table lists where those
+// pointers are, restoring maps the file privately and adds the base address
+// to each of them. image objects are not linked into vm->objects and are never
+// freed, chunks in the image have no capacity so they are treated as borrowed
+
+#define SNAPSHOT_MAGIC "LOXS"
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+// changes whenever a struct stored in the image changes size
+#define SNAPSHOT_LAYOUT ((uint64_t)sizeof(Value) | (uint64_t)sizeof(ObjString) << 8 |        \
+                         (uint64_t)sizeof(ObjFunction) << 16 | (uint64_t)sizeof(ObjClosure) << 24 | \
+                         (uint64_t)sizeof(ObjUpvalue) << 32 | (uint64_t)sizeof(ObjNative) << 40 |  \
+                         (uint64_t)sizeof(ObjSlice) << 48)
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t layout;
+    uint64_t size;
+    uint64_t relocOffset;
+    uint64_t relocCount;
+    uint64_t stringsOffset;
+    uint64_t stringCount;
+    uint64_t nativesOffset;
+    uint64_t nativeCount;
+    uint64_t globalsOffset;
+    uint64_t globalCount;
+} SnapshotHeader;
+
+typedef struct
+{
+    uint64_t key;
+    Value value;
+} SnapshotGlobal;
+
+typedef struct
+{
+    Obj *object;
+    uint64_t offset;
+} PlacedObject;
+
+typedef struct
+{
+    VM *vm; // compiles any bodies still skipped
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+
+    PlacedObject *placed; // open addressing map from object to offset
+    int placedCount;
+    int placedCapacity;
+
+    Obj **worklist;
+    int worklistCount;
+    int worklistCapacity;
+
+    uint64_t *relocs;
+    int relocCount;
+    int relocCapacity;
+    uint64_t *strings;
+    int stringCount;
+    int stringCapacity;
+    uint64_t *natives;
+    int nativeCount;
+    int nativeCapacity;
+
+    bool failed;
+} SnapshotWriter;
+
+#define APPEND(type, array, count, capacity, value)                             \
+    do                                                                          \
+    {                                                                           \
+        if ((capacity) < (count) + 1)                                           \
+        {                                                                       \
+            int oldCapacity = (capacity);                                       \
+            (capacity) = GROW_CAPACITY(oldCapacity);                            \
+            (array) = GROW_ARRAY(type, (array), oldCapacity, (capacity));       \
+        }                                                                       \
+        (array)[(count)++] = (value);                                           \
+    } while (false)
+
+// reserves zeroed, 8 byte aligned space and returns its offset
+static uint64_t reserve(SnapshotWriter *writer, size_t size)
+{
+    size = ALIGN8(size);
+    if (writer->capacity < writer->count + size)
+    {
+        size_t oldCapacity = writer->capacity;
+        while (writer->capacity < writer->count + size)
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    uint64_t offset = writer->count;
+    memset(writer->bytes + offset, 0, size);
+    writer->count += size;
+    return offset;
+}
+
+static uint64_t copyBytes(SnapshotWriter *writer, const void *bytes, size_t size)
+{
+    if (bytes == NULL || size == 0)
+        return 0;
+    uint64_t offset = reserve(writer, size);
+    memcpy(writer->bytes + offset, bytes, size);
+    return offset;
+}
+
+// stores an image offset into a pointer field and records it for relocation
+static void setPointer(SnapshotWriter *writer, uint64_t field, uint64_t target)
+{
+    memcpy(writer->bytes + field, &target, sizeof(target));
+    if (target != 0)
+        APPEND(uint64_t, writer->relocs, writer->relocCount, writer->relocCapacity, field);
+}
+
+static uint32_t hashPointer(Obj *object)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)((bits * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+static PlacedObject *findPlaced(PlacedObject *placed, int capacity, Obj *object)
+{
+    uint32_t index = hashPointer(object) & (capacity - 1);
+    while (placed[index].object != NULL && placed[index].object != object)
+        index = (index + 1) & (capacity - 1);
+    return &placed[index];
+}
+
+static size_t objectSize(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure);
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction);
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_STRING:
+        return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+    case OBJ_ROPE:
+        break; // placeObject() flattens ropes
+    case OBJ_CHANNEL:
+    case OBJ_COROUTINE:
+    case OBJ_ISOLATE:
+        break; // placeObject() refuses them
+    case OBJ_SLICE:
+        return sizeof(ObjSlice);
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    }
+    return 0; // unreachable
+}
+
+// returns the image offset of an object, reserving it on first sight
+static uint64_t placeObject(SnapshotWriter *writer, Obj *object)
+{
+    if (object == NULL)
+        return 0;
+
+    // channels and threads don't outlive the process, and a coroutine's
+    // stacks aren't part of the image
+    if (object->type == OBJ_CHANNEL || object->type == OBJ_COROUTINE ||
+        object->type == OBJ_ISOLATE)
+    {
+        writer->failed = true;
+        return 0;
+    }
+
+    // the image only holds flat strings
+    if (object->type == OBJ_ROPE)
+        object = (Obj *)flattenRope((ObjRope *)object);
+
+    if ((writer->placedCount + 1) * 2 > writer->placedCapacity)
+    {
+        int capacity = writer->placedCapacity == 0 ? 64 : writer->placedCapacity * 2;
+        PlacedObject *placed = ALLOCATE(PlacedObject, capacity);
+        memset(placed, 0, sizeof(PlacedObject) * capacity);
+        for (int i = 0; i < writer->placedCapacity; i++)
+        {
+            if (writer->placed[i].object != NULL)
+                *findPlaced(placed, capacity, writer->placed[i].object) = writer->placed[i];
+        }
+        FREE_ARRAY(PlacedObject, writer->placed, writer->placedCapacity);
+        writer->placed = placed;
+        writer->placedCapacity = capacity;
+    }
+
+    PlacedObject *entry = findPlaced(writer->placed, writer->placedCapacity, object);
+    if (entry->object != NULL)
+        return entry->offset;
+
+    // lazily skipped bodies point into a source that won't outlive the snapshot
+    if (object->type == OBJ_FUNCTION && ((ObjFunction *)object)->lazySource != NULL &&
+        !compileLazy(writer->vm, (ObjFunction *)object))
+    {
+        writer->failed = true;
+    }
+
+    entry->object = object;
+    entry->offset = reserve(writer, objectSize(object));
+    writer->placedCount++;
+    APPEND(Obj *, writer->worklist, writer->worklistCount, writer->worklistCapacity, object);
+    return entry->offset;
+}
+
+static void writeValue(SnapshotWriter *writer, uint64_t field, Value value)
+{
+    memcpy(writer->bytes + field, &value, sizeof(Value));
+    if (IS_OBJ(value))
+        setPointer(writer, field + offsetof(Value, as.obj), placeObject(writer, AS_OBJ(value)));
+}
+
+static uint64_t writePointerArray(SnapshotWriter *writer, Obj **objects, int count)
+{
+    if (objects == NULL || count == 0)
+        return 0;
+    uint64_t array = reserve(writer, sizeof(Obj *) * count);
+    for (int i = 0; i < count; i++)
+    {
+        setPointer(writer, array + sizeof(Obj *) * i, placeObject(writer, objects[i]));
+    }
+    return array;
+}
+
+static void writeObject(SnapshotWriter *writer, Obj *object)
+{
+    uint64_t offset = placeObject(writer, object);
+    memcpy(writer->bytes + offset, object, objectSize(object));
+    setPointer(writer, offset + offsetof(Obj, next), 0);
+    ((Obj *)(writer->bytes + offset))->frozen = false;
+
+    switch (object->type)
+    {
+    case OBJ_ROPE:
+    case OBJ_CHANNEL:
+    case OBJ_COROUTINE:
+    case OBJ_ISOLATE:
+        break; // never placed
+    case OBJ_SLICE:
+    {
+        ObjSlice *slice = (ObjSlice *)object;
+        setPointer(writer, offset + offsetof(ObjSlice, parent), placeObject(writer, (Obj *)slice->parent));
+        break;
+    }
+    case OBJ_STRING:
+    {
+        APPEND(uint64_t, writer->strings, writer->stringCount, writer->stringCapacity, offset);
+        break;
+    }
+    case OBJ_NATIVE:
+    {
+        ObjNative *native = (ObjNative *)object;
+        memset(writer->bytes + offset + offsetof(ObjNative, function), 0, sizeof(NativeFn));
+        uint64_t name = copyBytes(writer, native->name, strlen(native->name) + 1);
+        setPointer(writer, offset + offsetof(ObjNative, name), name);
+        APPEND(uint64_t, writer->natives, writer->nativeCount, writer->nativeCapacity, offset);
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        Chunk *chunk = &function->chunk;
+        uint64_t chunkOffset = offset + offsetof(ObjFunction, chunk);
+
+        setPointer(writer, chunkOffset + offsetof(Chunk, code),
+                   copyBytes(writer, chunk->code, chunk->count));
+        setPointer(writer, chunkOffset + offsetof(Chunk, lines),
+                   copyBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount));
+
+        uint64_t values = chunk->constants.count == 0 ? 0 : reserve(writer, sizeof(Value) * chunk->constants.count);
+        for (int i = 0; i < chunk->constants.count; i++)
+        {
+            writeValue(writer, values + sizeof(Value) * i, chunk->constants.values[i]);
+        }
+        setPointer(writer, chunkOffset + offsetof(Chunk, constants) + offsetof(ValueArray, values), values);
+
+        // chunks without capacity are borrowed and never grown or freed
+        ObjFunction *copy = (ObjFunction *)(writer->bytes + offset);
+        copy->chunk.capacity = 0;
+        copy->chunk.lineCapacity = 0;
+        copy->chunk.constants.capacity = 0;
+
+        setPointer(writer, offset + offsetof(ObjFunction, name), placeObject(writer, (Obj *)function->name));
+        setPointer(writer, offset + offsetof(ObjFunction, lazySource), 0);
+        setPointer(writer, offset + offsetof(ObjFunction, upvalueNames),
+                   writePointerArray(writer, (Obj **)function->upvalueNames, function->upvalueCount));
+        break;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        setPointer(writer, offset + offsetof(ObjClosure, function), placeObject(writer, (Obj *)closure->function));
+        setPointer(writer, offset + offsetof(ObjClosure, upvalues),
+                   writePointerArray(writer, (Obj **)closure->upvalues, closure->upvalueCount));
+        break;
+    }
+    case OBJ_UPVALUE:
+    {
+        ObjUpvalue *upvalue = (ObjUpvalue *)object;
+        if (upvalue->location != &upvalue->closed)
+        {
+            // an open upvalue points into a stack that isn't part of the image
+            writer->failed = true;
+            break;
+        }
+        setPointer(writer, offset + offsetof(ObjUpvalue, location), offset + offsetof(ObjUpvalue, closed));
+        writeValue(writer, offset + offsetof(ObjUpvalue, closed), upvalue->closed);
+        setPointer(writer, offset + offsetof(ObjUpvalue, next), 0);
+        break;
+    }
+    }
+}
+
+static uint64_t writeOffsets(SnapshotWriter *writer, uint64_t *offsets, int count)
+{
+    return copyBytes(writer, offsets, sizeof(uint64_t) * count);
+}
+
+bool writeSnapshot(VM *vm, const char *path)
+{
+    SnapshotWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.vm = vm;
+    reserve(&writer, sizeof(SnapshotHeader));
+
+    int globalCount = 0;
+    for (int i = 0; i < vm->globals.capacity; i++)
+    {
+        if (vm->globals.entries[i].key != NULL)
+            globalCount++;
+    }
+
+    uint64_t globals = reserve(&writer, sizeof(SnapshotGlobal) * globalCount);
+    int global = 0;
+    for (int i = 0; i < vm->globals.capacity; i++)
+    {
+        Entry *entry = &vm->globals.entries[i];
+        if (entry->key == NULL)
+            continue;
+        uint64_t slot = globals + sizeof(SnapshotGlobal) * global++;
+        setPointer(&writer, slot + offsetof(SnapshotGlobal, key), placeObject(&writer, (Obj *)entry->key));
+        writeValue(&writer, slot + offsetof(SnapshotGlobal, value), entry->value);
+    }
+
+    // objects are copied as they are reached, breadth first
+    for (int next = 0; next < writer.worklistCount && !writer.failed; next++)
+    {
+        writeObject(&writer, writer.worklist[next]);
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.layout = SNAPSHOT_LAYOUT;
+    header.globalsOffset = globals;
+    header.globalCount = (uint64_t)globalCount;
+    header.stringsOffset = writeOffsets(&writer, writer.strings, writer.stringCount);
+    header.stringCount = (uint64_t)writer.stringCount;
+    header.nativesOffset = writeOffsets(&writer, writer.natives, writer.nativeCount);
+    header.nativeCount = (uint64_t)writer.nativeCount;
+    header.relocCount = (uint64_t)writer.relocCount;
+    header.relocOffset = writeOffsets(&writer, writer.relocs, writer.relocCount);
+    header.size = writer.count;
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    bool written = false;
+    if (!writer.failed)
+    {
+        FILE *file = fopen(path, "wb");
+        if (file != NULL)
+        {
+            written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+            written = fclose(file) == 0 && written;
+        }
+    }
+
+    FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+    FREE_ARRAY(PlacedObject, writer.placed, writer.placedCapacity);
+    FREE_ARRAY(Obj *, writer.worklist, writer.worklistCapacity);
+    FREE_ARRAY(uint64_t, writer.relocs, writer.relocCapacity);
+    FREE_ARRAY(uint64_t, writer.strings, writer.stringCapacity);
+    FREE_ARRAY(uint64_t, writer.natives, writer.nativeCapacity);
+    return written;
+}
+
+static bool inImage(const SnapshotHeader *header, uint64_t offset, uint64_t size)
+{
+    return offset <= header->size && size <= header->size - offset;
+}
+
+bool loadSnapshot(VM *vm, const char *path, SnapshotImage *image)
+{
+    image->region = NULL;
+    image->size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    uint8_t *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    image->region = base;
+    image->size = (size_t)st.st_size;
+
+    const SnapshotHeader *header = (const SnapshotHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->layout != SNAPSHOT_LAYOUT ||
+        header->size != image->size ||
+        !inImage(header, header->relocOffset, header->relocCount * sizeof(uint64_t)) ||
+        !inImage(header, header->stringsOffset, header->stringCount * sizeof(uint64_t)) ||
+        !inImage(header, header->nativesOffset, header->nativeCount * sizeof(uint64_t)) ||
+        !inImage(header, header->globalsOffset, header->globalCount * sizeof(SnapshotGlobal)))
+    {
+        closeSnapshot(image);
+        return false;
+    }
+
+    const uint64_t *relocs = (const uint64_t *)(base + header->relocOffset);
+    for (uint64_t i = 0; i < header->relocCount; i++)
+    {
+        uint64_t target;
+        if (!inImage(header, relocs[i], sizeof(uint64_t)))
+        {
+            closeSnapshot(image);
+            return false;
+        }
+        memcpy(&target, base + relocs[i], sizeof(target));
+        if (target >= header->size)
+        {
+            closeSnapshot(image);
+            return false;
+        }
+        uintptr_t pointer = (uintptr_t)(base + target);
+        memcpy(base + relocs[i], &pointer, sizeof(pointer));
+    }
+
+    const uint64_t *natives = (const uint64_t *)(base + header->nativesOffset);
+    for (uint64_t i = 0; i < header->nativeCount; i++)
+    {
+        if (!inImage(header, natives[i], sizeof(ObjNative)))
+        {
+            closeSnapshot(image);
+            return false;
+        }
+        ObjNative *native = (ObjNative *)(base + natives[i]);
+        const NativeDef *def = findNative(native->name);
+        if (def == NULL)
+        {
+            fprintf(stderr, "Snapshot uses unknown native function '%s'.\n", native->name);
+            closeSnapshot(image);
+            return false;
+        }
+        native->function = def->function;
+        native->name = def->name;
+    }
+
+    const uint64_t *strings = (const uint64_t *)(base + header->stringsOffset);
+    for (uint64_t i = 0; i < header->stringCount; i++)
+    {
+        if (!inImage(header, strings[i], sizeof(ObjString)))
+        {
+            closeSnapshot(image);
+            return false;
+        }
+    }
+
+    // the image replaces whatever initVM() interned and defined
+    freeInternSet(&vm->strings);
+    freeTable(&vm->globals);
+
+    // stored hashes were keyed with the writing process's seed
+    for (uint64_t i = 0; i < header->stringCount; i++)
+    {
+        ObjString *string = (ObjString *)(base + strings[i]);
+        string->hash = 0;
+        if (string->interned)
+        {
+            stringHash(string);
+            internSetAdd(&vm->strings, string);
+        }
+    }
+
+    const SnapshotGlobal *globals = (const SnapshotGlobal *)(base + header->globalsOffset);
+    for (uint64_t i = 0; i < header->globalCount; i++)
+    {
+        ObjString *key;
+        memcpy(&key, &globals[i].key, sizeof(key));
+        tableSet(&vm->globals, key, globals[i].value);
+    }
+
+    // natives added since the snapshot was taken, under names the script
+    // hasn't taken for its own globals
+    defineNatives(vm);
+    return true;
+}
+
+void closeSnapshot(SnapshotImage *image)
+{
+    if (image->region != NULL)
+        munmap(image->region, image->size);
+    image->region = NULL;
+    image->size = 0;
+}
@@ -1,55 +1,106 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// control bytes: a full slot holds the low 7 bits of its key's hash, the
+// high bit marks a free slot. the rest of the hash picks the first group
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+// up to 7/8 of the slots may be full or deleted
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash)&0x7f))
 
 void initTable(Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table *table)
 {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+// bitmask of the slots in a group whose control byte is byte
+static inline uint32_t groupMatch(const uint8_t *group, uint8_t byte)
 {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] == byte)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-    for (;;)
+// bitmask of the empty or deleted slots in a group
+static inline uint32_t groupMatchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
     {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                // if we found an empty entry and we previously found a tombstone in this probe sequence
-                // return the tombstone, else return the empty entry
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // found a tombstone
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+        if (group[i] & CTRL_EMPTY)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// triangular steps over the groups, which visits every group of a power of two table
+#define FOR_EACH_GROUP(capacity, hash, group)                                 \
+    for (uint32_t groupMask_ = (uint32_t)(capacity) / TABLE_GROUP_WIDTH - 1,    \
+                  step_ = 0, group = HASH_GROUP(hash) & groupMask_;             \
+         ;                                                                    \
+         step_++, group = (group + step_) & groupMask_)
+
+static inline int findSlot(Table *table, ObjString *key)
+{
+    uint8_t tag = HASH_TAG(key->hash);
+    FOR_EACH_GROUP(table->capacity, key->hash, group)
+    {
+        const uint8_t *control = &table->control[group * TABLE_GROUP_WIDTH];
+        for (uint32_t matches = groupMatch(control, tag); matches != 0; matches &= matches - 1)
         {
-            return entry;
+            int slot = group * TABLE_GROUP_WIDTH + __builtin_ctz(matches);
+            if (table->entries[slot].key == key)
+                return slot;
         }
+        if (groupMatch(control, CTRL_EMPTY) != 0)
+            return -1;
+    }
+}
 
-        index = (index + 1) % capacity;
+static int findFreeSlot(uint8_t *control, int capacity, uint32_t hash)
+{
+    FOR_EACH_GROUP(capacity, hash, group)
+    {
+        uint32_t free = groupMatchFree(&control[group * TABLE_GROUP_WIDTH]);
+        if (free != 0)
+            return group * TABLE_GROUP_WIDTH + __builtin_ctz(free);
     }
 }
 
@@ -58,55 +109,83 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot == -1)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 static void adjustCapacity(Table *table, int capacity)
 {
+    uint8_t *control = ALLOCATE(uint8_t, capacity);
     Entry *entries = ALLOCATE(Entry, capacity);
+    memset(control, CTRL_EMPTY, capacity);
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
-    table->count = 0;
+
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
         if (entry->key == NULL)
             continue;
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int slot = findFreeSlot(control, capacity, entry->key->hash);
+        control[slot] = HASH_TAG(entry->key->hash);
+        entries[slot] = *entry;
     }
 
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
+}
+
+// smallest table that holds count entries below half load
+static int capacityFor(int count)
+{
+    int capacity = TABLE_GROUP_WIDTH;
+    while (capacity / 2 < count)
+        capacity *= 2;
+    return capacity;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (table->count > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        int slot = findSlot(table, key);
+        if (slot != -1)
+        {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity))
+    {
+        // mostly tombstones rehash in place, otherwise grow
+        int capacity = table->count + 1 > TABLE_MAX_LOAD(table->capacity) / 2
+                           ? GROW_CAPACITY(table->capacity)
+                           : table->capacity;
+        if (capacity < TABLE_GROUP_WIDTH)
+            capacity = TABLE_GROUP_WIDTH;
+        adjustCapacity(table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    int slot = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CTRL_DELETED)
+        table->tombstones--;
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table *table, ObjString *key)
@@ -114,13 +193,34 @@ bool tableDelete(Table *table, ObjString *key)
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot == -1)
         return false;
 
-    // create a tombstone
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // a group that still has an empty slot never overflowed, so no probe
+    // continues past it and the slot can go back to empty
+    uint8_t *group = &table->control[slot - slot % TABLE_GROUP_WIDTH];
+    if (groupMatch(group, CTRL_EMPTY) != 0)
+    {
+        table->control[slot] = CTRL_EMPTY;
+    }
+    else
+    {
+        table->control[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
+
+    if (table->count == 0)
+    {
+        freeTable(table);
+    }
+    else if (table->capacity > TABLE_GROUP_WIDTH && table->count < table->capacity / 8)
+    {
+        adjustCapacity(table, capacityFor(table->count));
+    }
     return true;
 }
 
@@ -135,28 +235,3 @@ void tableAddAll(Table *from, Table *to)
         }
     }
 }
-
-ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
-{
-    if (table->count == 0)
-        return NULL;
-
-    uint32_t index = hash % table->capacity;
-    for (;;)
-    {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
-        {
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
-    }
-}
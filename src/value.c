@@ -3,6 +3,7 @@
 
 #include "object.h"
 #include "memory.h"
+#include "number.h"
 #include "value.h"
 
 void initValueArray(ValueArray *array)
@@ -28,47 +29,106 @@ void writeValueArray(ValueArray *array, Value value)
 
 void freeValueArray(ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    // like a chunk's code, constants without capacity are borrowed
+    if (array->capacity > 0)
+        FREE_ARRAY(Value, array->values, array->capacity);
     initValueArray(array);
 }
 
-void printValue(Value value)
+// locks out once for the whole value, so the writes inside it only take a
+// lock already held
+void printValue(FILE *out, Value value)
 {
+    flockfile(out);
     switch (value.type)
     {
     case VAL_BOOL:
     {
-        printf(AS_BOOL(value) ? "true" : "false");
+        fputs(AS_BOOL(value) ? "true" : "false", out);
         break;
     }
     case VAL_NIL:
     {
-        printf("nil");
+        fputs("nil", out);
         break;
     }
     case VAL_ERROR_ARGC:
     case VAL_ERROR_ARGV:
+    case VAL_SWITCHED:
     {
-        printf("error");
+        fputs("error", out);
         break;
     }
     case VAL_NUMBER:
     {
-        printf("%g", AS_NUMBER(value));
+        char text[NUMBER_TEXT_MAX];
+        fwrite(text, 1, formatNumber(AS_NUMBER(value), text), out);
+        break;
+    }
+    case VAL_INT:
+    {
+        char text[NUMBER_TEXT_MAX];
+        fwrite(text, 1, formatInteger(AS_INT(value), text), out);
         break;
     }
     case VAL_OBJ:
     {
-        printObject(value);
+        printObject(out, value);
+        break;
+    }
+    case VAL_SMALL_STRING:
+    {
+#ifdef DEBUG_TRACE_EXECUTION
+        fprintf(out, "\"%.*s\"", smallLength(value), value.as.small);
+#endif
+#ifndef DEBUG_TRACE_EXECUTION
+        fwrite(value.as.small, 1, (size_t)smallLength(value), out);
+#endif
         break;
     }
     }
+    funlockfile(out);
+}
+
+// false when chars don't fit, or hold a NUL that would read as padding
+bool makeSmallString(const char *chars, int length, Value *value)
+{
+    if (length > SMALL_STRING_MAX || memchr(chars, '\0', length) != NULL)
+        return false;
+
+    value->type = VAL_SMALL_STRING;
+    memset(value->as.small, 0, SMALL_STRING_MAX);
+    memcpy(value->as.small, chars, length);
+    return true;
+}
+
+// strings in different representations, compared by contents
+static bool textsEqual(Value a, Value b)
+{
+    if (IS_STRING(a) && IS_STRING(b))
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+
+    int length = textLength(a);
+    return length == textLength(b) && memcmp(textChars(&a), textChars(&b), length) == 0;
+}
+
+// exact, unlike comparing the integer promoted to a double
+static bool intEqualsNumber(int64_t integer, double number)
+{
+    return number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+           (int64_t)number == integer && (double)(int64_t)number == number;
 }
 
 bool valuesEqual(Value a, Value b)
 {
     if (a.type != b.type)
-        return false;
+    {
+        if (IS_INT(a) && IS_NUMBER(b))
+            return intEqualsNumber(AS_INT(a), AS_NUMBER(b));
+        if (IS_NUMBER(a) && IS_INT(b))
+            return intEqualsNumber(AS_INT(b), AS_NUMBER(a));
+        return IS_TEXT(a) && IS_TEXT(b) && textsEqual(a, b);
+    }
 
     switch (a.type)
     {
@@ -77,11 +137,18 @@ bool valuesEqual(Value a, Value b)
     case VAL_NIL:
     case VAL_ERROR_ARGC:
     case VAL_ERROR_ARGV:
+    case VAL_SWITCHED:
         return true;
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT:
+        return AS_INT(a) == AS_INT(b);
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        if (AS_OBJ(a) == AS_OBJ(b))
+            return true;
+        return IS_TEXT(a) && IS_TEXT(b) && textsEqual(a, b);
+    case VAL_SMALL_STRING:
+        return memcmp(a.as.small, b.as.small, SMALL_STRING_MAX) == 0;
     default:
         return false; // unreachable
     }
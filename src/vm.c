@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -5,114 +6,207 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hash.h"
 #include "object.h"
 #include "memory.h"
 #include "natives.h"
 #include "vm.h"
 
-VM vm;
-
-static void resetStack()
+// an error anywhere unwinds every coroutine in the way back to the main
+// program. their stacks stay allocated, upvalues may still point into them
+static void resetStack(VM *vm)
 {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    for (ObjCoroutine *coroutine = vm->coroutine; coroutine != NULL; coroutine = coroutine->resumer)
+    {
+        coroutine->state = COROUTINE_DONE;
+    }
+    vm->coroutine = NULL;
+
+    vm->frames = vm->mainFrames;
+    vm->stack = vm->mainStack;
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
-static void runtimeError(const char *format, ...)
+static void printTrace(FILE *err, CallFrame *frames, int frameCount)
 {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
-
-    for (int i = vm.frameCount - 1; i >= 0; i--)
+    for (int i = frameCount - 1; i >= 0; i--)
     {
-        CallFrame *frame = &vm.frames[i];
+        CallFrame *frame = &frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
+        fprintf(err, "[line %d] in ", getLine(&function->chunk, instruction));
         if (function->name == NULL)
         {
-            fprintf(stderr, "script\n");
+            fprintf(err, "script\n");
         }
         else
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(err, "%s()\n", function->name->chars);
         }
     }
+}
+
+static Fiber *resumerFiber(VM *vm, ObjCoroutine *coroutine)
+{
+    return coroutine->resumer != NULL ? &coroutine->resumer->fiber : &vm->main;
+}
+
+static void runtimeError(VM *vm, const char *format, ...)
+{
+    // what was printed before the error comes out ahead of it
+    fflush(vm->out);
+    va_list args;
+    va_start(args, format);
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputs("\n", vm->err);
+
+    // a coroutine's trace carries on through whatever resumed it
+    printTrace(vm->err, vm->frames, vm->frameCount);
+    for (ObjCoroutine *coroutine = vm->coroutine; coroutine != NULL; coroutine = coroutine->resumer)
+    {
+        Fiber *resumer = resumerFiber(vm, coroutine);
+        printTrace(vm->err, resumer->frames, resumer->frameCount);
+    }
 
-    resetStack();
+    resetStack(vm);
 }
 
-static void defineNative(const char *name, NativeFn function)
+// a global already holding the name keeps its value, so natives defined
+// over a restored snapshot don't replace the script's own functions
+static void defineNative(VM *vm, const char *name, NativeFn function)
 {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function, name)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    Value existing;
+    if (tableGet(&vm->globals, AS_STRING(vm->stack[0]), &existing))
+    {
+        pop(vm);
+        return;
+    }
+    push(vm, OBJ_VAL(newNative(vm, function, name)));
+    tableSet(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
 }
 
-void initVM()
+// a vm given a program shares its functions and constant strings, the
+// natives defined here are keyed by the program's names
+void initVM(VM *vm, Program *program)
 {
-    resetStack();
-    vm.objects = NULL;
+    seedHash();
+    vm->coroutine = NULL;
+    resetStack(vm);
+    vm->fuel = FUEL_UNLIMITED;
+    vm->isolateFuel = FUEL_UNLIMITED;
+    vm->program = program;
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->objects = NULL;
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    initTable(&vm->globals);
+    initInternSet(&vm->strings);
 
-    defineNative("clock", n_clock);
-    defineNative("triple", n_triple);
+    defineNatives(vm);
 }
 
-void freeVM()
+void defineNatives(VM *vm)
 {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+    for (const NativeDef *def = nativeDefs; def->name != NULL; def++)
+    {
+        defineNative(vm, def->name, def->function);
+    }
+}
+
+void freeVM(VM *vm)
+{
+    freeTable(&vm->globals);
+    freeInternSet(&vm->strings);
+    freeObjects(vm->objects);
 }
 
-void push(Value value)
+void push(VM *vm, Value value)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop()
+Value pop(VM *vm)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
 {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int argCount)
+// makes room in the running coroutine's stacks for one more frame and a
+// stack height of slots. a moved stack takes the frames' slots, the top
+// and open upvalues with it
+static void growFiber(VM *vm, Fiber *fiber, int slots)
 {
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm->frameCount == fiber->frameCapacity)
     {
-        runtimeError("Stack overflow.");
+        int capacity = fiber->frameCapacity * 2 < FRAMES_MAX ? fiber->frameCapacity * 2 : FRAMES_MAX;
+        vm->frames = GROW_ARRAY(CallFrame, vm->frames, fiber->frameCapacity, capacity);
+        fiber->frames = vm->frames;
+        fiber->frameCapacity = capacity;
+    }
+
+    // past STACK_MAX a frame gets what the main program's would
+    if (slots <= fiber->stackCapacity || fiber->stackCapacity == STACK_MAX)
+        return;
+    int capacity = fiber->stackCapacity;
+    while (capacity < slots && capacity < STACK_MAX)
+        capacity *= 2;
+
+    Value *stack = ALLOCATE(Value, capacity);
+    memcpy(stack, vm->stack, sizeof(Value) * (size_t)(vm->stackTop - vm->stack));
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+    FREE_ARRAY(Value, vm->stack, fiber->stackCapacity);
+    vm->stack = stack;
+    fiber->stack = stack;
+    fiber->stackCapacity = capacity;
+}
+
+static bool call(VM *vm, ObjClosure *closure, int argCount)
+{
+    if (vm->frameCount == FRAMES_MAX)
+    {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
     if (argCount != closure->function->arity)
     {
-        runtimeError("Expected %d arguments, got %d, for function '%s'.", closure->function->arity, argCount, closure->function->name->chars);
+        runtimeError(vm, "Expected %d arguments, got %d, for function '%s'.", closure->function->arity, argCount, closure->function->name->chars);
+        return false;
+    }
+
+    if (closure->function->lazySource != NULL && !compileLazy(vm, closure->function))
+    {
+        runtimeError(vm, "Could not compile function '%s'.", closure->function->name->chars);
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    if (vm->coroutine != NULL)
+        growFiber(vm, &vm->coroutine->fiber, (int)(vm->stackTop - argCount - 1 - vm->stack) + closure->function->stackSize);
+
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
-static bool callValue(Value callee, int argCount)
+static bool callValue(VM *vm, Value callee, int argCount)
 {
     if (IS_OBJ(callee))
     {
@@ -122,37 +216,39 @@ static bool callValue(Value callee, int argCount)
         {
             ObjNative *native = AS_NATIVE_OBJ(callee);
             NativeFn func = native->function;
-            Value result = func(argCount, vm.stackTop - argCount);
+            Value result = func(vm, argCount, vm->stackTop - argCount);
+            if (IS_SWITCHED(result))
+                return true;
             if (IS_ERR_ARGC(result))
             {
-                runtimeError("Invalid argument count for native function '%s'.", native->name);
+                runtimeError(vm, "Invalid argument count for native function '%s'.", native->name);
                 return false;
             }
             if (IS_ERR_ARGV(result))
             {
-                runtimeError("Invalid argument type for native function '%s'.", native->name);
+                runtimeError(vm, "Invalid argument type for native function '%s'.", native->name);
                 return false;
             }
-            vm.stackTop -= argCount + 1;
-            push(result);
+            vm->stackTop -= argCount + 1;
+            push(vm, result);
             return true;
         }
         case OBJ_CLOSURE:
         {
-            return call(AS_CLOSURE(callee), argCount);
+            return call(vm, AS_CLOSURE(callee), argCount);
         }
         default:
             break;
         }
     }
-    runtimeError("Can only call functions and classes");
+    runtimeError(vm, "Can only call functions and classes");
     return false;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local)
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local)
 {
     ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    ObjUpvalue *upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local)
     {
         prevUpvalue = upvalue;
@@ -164,13 +260,13 @@ static ObjUpvalue *captureUpvalue(Value *local)
         return upvalue;
     }
 
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
+    ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
 
     createdUpvalue->next = upvalue;
 
     if (prevUpvalue == NULL)
     {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     }
     else
     {
@@ -180,14 +276,14 @@ static ObjUpvalue *captureUpvalue(Value *local)
     return createdUpvalue;
 }
 
-static void closeUpValues(Value *last)
+static void closeUpValues(VM *vm, Value *last)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last)
     {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+        ObjUpvalue *upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues = upvalue->next;
     }
 }
 
@@ -196,53 +292,250 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static void concatenate(VM *vm)
 {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
+    Value b = pop(vm);
+    Value a = pop(vm);
+
+    int leftLength = textLength(a);
+    int length = leftLength + textLength(b);
+    if (length >= ROPE_MIN_LENGTH)
+    {
+        push(vm, OBJ_VAL(newRope(vm, a, b, length)));
+        return;
+    }
+
+    // anything this short holds no ropes, so nothing gets flattened here
+    if (length <= SMALL_STRING_MAX)
+    {
+        char chars[SMALL_STRING_MAX];
+        memcpy(chars, textChars(&a), leftLength);
+        memcpy(chars + leftLength, textChars(&b), length - leftLength);
+        push(vm, copyText(vm, chars, length));
+        return;
+    }
 
-    int length = a->length + b->length;
-    ObjString *result = makeString(length);
-    memcpy(result->chars, a->chars, a->length);
-    memcpy(result->chars + a->length, b->chars, b->length);
+    ObjString *result = makeString(vm, length);
+    memcpy(result->chars, textChars(&a), leftLength);
+    memcpy(result->chars + leftLength, textChars(&b), length - leftLength);
     result->chars[length] = '\0';
-    result->hash = hashString(result->chars, length);
 
-    result = internString(result);
+    push(vm, OBJ_VAL(result));
+}
+
+static void saveFiber(VM *vm, Fiber *fiber)
+{
+    fiber->frames = vm->frames;
+    fiber->frameCount = vm->frameCount;
+    fiber->stack = vm->stack;
+    fiber->stackTop = vm->stackTop;
+    fiber->openUpvalues = vm->openUpvalues;
+}
+
+static void loadFiber(VM *vm, Fiber *fiber)
+{
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->openUpvalues = fiber->openUpvalues;
+}
+
+// switches to a suspended coroutine, handing it value as the result of its
+// yield or, on the first resume, as its argument when it takes one. callee
+// is the resuming native's slot, the resumer carries on from there when the
+// coroutine yields back
+bool resumeCoroutine(VM *vm, ObjCoroutine *coroutine, Value value, bool pulled, Value *callee)
+{
+    if (coroutine->state != COROUTINE_SUSPENDED)
+        return false;
+
+    vm->stackTop = callee;
+    saveFiber(vm, vm->coroutine != NULL ? &vm->coroutine->fiber : &vm->main);
+    coroutine->state = COROUTINE_RUNNING;
+    coroutine->pulled = pulled;
+    coroutine->resumer = vm->coroutine;
+    vm->coroutine = coroutine;
+    loadFiber(vm, &coroutine->fiber);
+
+    if (coroutine->started)
+    {
+        push(vm, value);
+        return true;
+    }
 
-    push(OBJ_VAL(result));
+    // the body was compiled when the coroutine was made, so this can't fail
+    coroutine->started = true;
+    ObjClosure *closure = AS_CLOSURE(vm->stack[0]);
+    if (closure->function->arity == 1)
+        push(vm, value);
+    call(vm, closure, closure->function->arity);
+    return true;
 }
 
-static InterpretResult run()
+// suspends the running coroutine and hands value to whatever resumed it
+bool yieldCoroutine(VM *vm, Value value, Value *callee)
 {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjCoroutine *coroutine = vm->coroutine;
+    if (coroutine == NULL)
+        return false;
+
+    vm->stackTop = callee;
+    saveFiber(vm, &coroutine->fiber);
+    coroutine->state = COROUTINE_SUSPENDED;
+    vm->coroutine = coroutine->resumer;
+    loadFiber(vm, resumerFiber(vm, coroutine));
+    push(vm, value);
+    return true;
+}
+
+// the coroutine's function has returned. next() only wants what it yielded
+static void finishCoroutine(VM *vm, Value result)
+{
+    ObjCoroutine *coroutine = vm->coroutine;
+    coroutine->state = COROUTINE_DONE;
+    vm->coroutine = coroutine->resumer;
+    loadFiber(vm, resumerFiber(vm, coroutine));
+    freeFiber(&coroutine->fiber);
+    push(vm, coroutine->pulled ? NIL_VAL : result);
+}
+
+static InterpretResult run(VM *vm)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
     register uint8_t *ip = frame->ip;
 #define READ_BYTE() (*ip++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT() \
     (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define BINARY_OP(valueType, op)                        \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            frame->ip = ip;                             \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPERT_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
+#define NUMBERS_ERROR()                                \
+    do                                                 \
+    {                                                  \
+        frame->ip = ip;                                \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPERT_RUNTIME_ERROR;                \
+    } while (false)
+// integers compare as integers, anything involving a double as doubles
+#define COMPARE_OP(op)                                                     \
+    do                                                                     \
+    {                                                                      \
+        Value b = peek(vm, 0);                                             \
+        Value a = peek(vm, 1);                                             \
+        if (IS_INT(a) && IS_INT(b))                                        \
+            vm->stackTop[-2] = BOOL_VAL(AS_INT(a) op AS_INT(b));           \
+        else if (IS_NUMERIC(a) && IS_NUMERIC(b))                           \
+            vm->stackTop[-2] = BOOL_VAL(AS_FLOAT(a) op AS_FLOAT(b));       \
+        else                                                               \
+            NUMBERS_ERROR();                                               \
+        vm->stackTop--;                                                    \
+    } while (false)
+// integers stay integers until a result doesn't fit, which becomes a double
+// the way every number did before integers
+#define ARITHMETIC_OP(checkedOp, op)                                                 \
+    do                                                                               \
+    {                                                                                \
+        Value b = peek(vm, 0);                                                       \
+        Value a = peek(vm, 1);                                                       \
+        if (IS_INT(a) && IS_INT(b))                                                  \
+        {                                                                            \
+            int64_t result;                                                          \
+            vm->stackTop[-2] = checkedOp(AS_INT(a), AS_INT(b), &result)              \
+                                   ? NUMBER_VAL((double)AS_INT(a) op (double)AS_INT(b)) \
+                                   : INT_VAL(result);                                \
+        }                                                                            \
+        else if (IS_NUMERIC(a) && IS_NUMERIC(b))                        \
+        {                                                               \
+            vm->stackTop[-2] = NUMBER_VAL(AS_FLOAT(a) op AS_FLOAT(b));  \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            NUMBERS_ERROR();                                            \
+        }                                                               \
+        vm->stackTop--;                                                 \
+    } while (false)
+#define BITWISE_OP(expression)                                      \
+    do                                                              \
+    {                                                               \
+        if (!IS_INT(peek(vm, 0)) || !IS_INT(peek(vm, 1)))           \
+        {                                                           \
+            frame->ip = ip;                                         \
+            runtimeError(vm, "Operands must be integers.");         \
+            return INTERPERT_RUNTIME_ERROR;                         \
+        }                                                           \
+        int64_t b = AS_INT(vm->stackTop[-1]);                       \
+        int64_t a = AS_INT(vm->stackTop[-2]);                       \
+        vm->stackTop--;                                             \
+        vm->stackTop[-1] = INT_VAL(expression);                     \
+    } while (false)
+// shifts by a negative count or by 64 or more are undefined in C, and
+// refused rather than wrapped
+#define SHIFT_COUNT_CHECK()                                                               \
+    do                                                                                    \
+    {                                                                                     \
+        if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)) &&                                 \
+            (AS_INT(peek(vm, 0)) < 0 || AS_INT(peek(vm, 0)) > 63))                        \
+        {                                                                                 \
+            frame->ip = ip;                                                               \
+            runtimeError(vm, "Shift count must be between 0 and 63.");                    \
+            return INTERPERT_RUNTIME_ERROR;                                               \
+        }                                                                                 \
+    } while (false)
+#ifdef DEBUG_VERIFY_TYPES
+#define VERIFY_OPERANDS(count, isType)                                            \
+    do                                                                            \
+    {                                                                             \
+        for (int i = 0; i < (count); i++)                                         \
+        {                                                                         \
+            if (!isType(peek(vm, i)))                                             \
+            {                                                                     \
+                frame->ip = ip;                                                   \
+                runtimeError(vm, "Unchecked operand is not of its proven type."); \
+                return INTERPERT_RUNTIME_ERROR;                                   \
+            }                                                                     \
+        }                                                                         \
+    } while (false)
+#else
+#define VERIFY_OPERANDS(count, isType) ((void)0)
+#endif
+#define NUMERIC_OP(valueType, op)                                      \
+    do                                                                 \
+    {                                                                  \
+        VERIFY_OPERANDS(2, IS_NUMERIC);                                \
+        double b = AS_FLOAT(vm->stackTop[-1]);                         \
+        double a = AS_FLOAT(vm->stackTop[-2]);                         \
+        vm->stackTop--;                                                \
+        vm->stackTop[-1] = valueType(a op b);                          \
+    } while (false)
+#define INTEGER_COMPARE(op)                                            \
+    do                                                                 \
+    {                                                                  \
+        VERIFY_OPERANDS(2, IS_INT);                                    \
+        int64_t b = AS_INT(vm->stackTop[-1]);                          \
+        int64_t a = AS_INT(vm->stackTop[-2]);                          \
+        vm->stackTop--;                                                \
+        vm->stackTop[-1] = BOOL_VAL(a op b);                           \
+    } while (false)
+#define INTEGER_OP(checkedOp, op)                                             \
+    do                                                                        \
+    {                                                                         \
+        VERIFY_OPERANDS(2, IS_INT);                                           \
+        int64_t b = AS_INT(vm->stackTop[-1]);                                 \
+        int64_t a = AS_INT(vm->stackTop[-2]);                                 \
+        int64_t result;                                                       \
+        vm->stackTop--;                                                       \
+        vm->stackTop[-1] = __builtin_expect(checkedOp(a, b, &result), 0)      \
+                               ? NUMBER_VAL((double)a op (double)b)           \
+                               : INT_VAL(result);                             \
     } while (false)
     for (;;)
     {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("\nstack:  ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+        for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
         {
             printf("[ ");
-            printValue(*slot);
+            printValue(stdout, *slot);
             printf(" ]");
         }
         printf("\n\n");
@@ -254,101 +547,230 @@ static InterpretResult run()
         case OP_CONSTANT:
         {
             Value constant = READ_CONSTANT();
-            push(constant);
+            push(vm, constant);
             break;
         }
         case OP_NIL:
         {
-            push(NIL_VAL);
+            push(vm, NIL_VAL);
             break;
         }
         case OP_TRUE:
         {
-            push(BOOL_VAL(true));
+            push(vm, BOOL_VAL(true));
             break;
         }
         case OP_FALSE:
         {
-            push(BOOL_VAL(false));
+            push(vm, BOOL_VAL(false));
             break;
         }
         case OP_EQUAL:
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(a, b)));
             break;
         }
         case OP_GREATER:
         {
-            BINARY_OP(BOOL_VAL, >);
+            COMPARE_OP(>);
             break;
         }
         case OP_LESS:
         {
-            BINARY_OP(BOOL_VAL, <);
+            COMPARE_OP(<);
             break;
         }
         case OP_ADD:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
             {
-                concatenate();
+                concatenate(vm);
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_NUMERIC(peek(vm, 0)) && IS_NUMERIC(peek(vm, 1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                ARITHMETIC_OP(__builtin_add_overflow, +);
             }
             else
             {
                 frame->ip = ip;
-                runtimeError("+ can only be used to concatenate two strings or add two numbers.");
+                runtimeError(vm, "+ can only be used to concatenate two strings or add two numbers.");
                 return INTERPERT_RUNTIME_ERROR;
             }
             break;
         }
         case OP_SUBTRACT:
         {
-            BINARY_OP(NUMBER_VAL, -);
+            ARITHMETIC_OP(__builtin_sub_overflow, -);
             break;
         }
         case OP_MULTIPLY:
         {
-            BINARY_OP(NUMBER_VAL, *);
+            ARITHMETIC_OP(__builtin_mul_overflow, *);
             break;
         }
         case OP_DIVIDE:
         {
-            BINARY_OP(NUMBER_VAL, /);
+            // always a double, even between integers
+            if (!IS_NUMERIC(peek(vm, 0)) || !IS_NUMERIC(peek(vm, 1)))
+                NUMBERS_ERROR();
+            double b = AS_FLOAT(pop(vm));
+            double a = AS_FLOAT(pop(vm));
+            push(vm, NUMBER_VAL(a / b));
+            break;
+        }
+        case OP_MODULO:
+        {
+            Value b = peek(vm, 0);
+            Value a = peek(vm, 1);
+            if (IS_INT(a) && IS_INT(b))
+            {
+                if (AS_INT(b) == 0)
+                {
+                    frame->ip = ip;
+                    runtimeError(vm, "Integer modulo by zero.");
+                    return INTERPERT_RUNTIME_ERROR;
+                }
+                // INT64_MIN % -1 traps in C
+                vm->stackTop[-2] = INT_VAL(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b));
+            }
+            else if (IS_NUMERIC(a) && IS_NUMERIC(b))
+            {
+                vm->stackTop[-2] = NUMBER_VAL(fmod(AS_FLOAT(a), AS_FLOAT(b)));
+            }
+            else
+            {
+                NUMBERS_ERROR();
+            }
+            vm->stackTop--;
+            break;
+        }
+        case OP_BIT_AND:
+        {
+            BITWISE_OP(a & b);
+            break;
+        }
+        case OP_BIT_OR:
+        {
+            BITWISE_OP(a | b);
+            break;
+        }
+        case OP_BIT_XOR:
+        {
+            BITWISE_OP(a ^ b);
+            break;
+        }
+        case OP_SHIFT_LEFT:
+        {
+            // shifting out the sign bit is not undefined
+            SHIFT_COUNT_CHECK();
+            BITWISE_OP((int64_t)((uint64_t)a << b));
+            break;
+        }
+        case OP_SHIFT_RIGHT:
+        {
+            SHIFT_COUNT_CHECK();
+            BITWISE_OP(a >> b);
+            break;
+        }
+        case OP_GREATER_NUM:
+        {
+            NUMERIC_OP(BOOL_VAL, >);
+            break;
+        }
+        case OP_LESS_NUM:
+        {
+            NUMERIC_OP(BOOL_VAL, <);
+            break;
+        }
+        case OP_ADD_NUM:
+        {
+            NUMERIC_OP(NUMBER_VAL, +);
+            break;
+        }
+        case OP_SUBTRACT_NUM:
+        {
+            NUMERIC_OP(NUMBER_VAL, -);
+            break;
+        }
+        case OP_MULTIPLY_NUM:
+        {
+            NUMERIC_OP(NUMBER_VAL, *);
+            break;
+        }
+        case OP_DIVIDE_NUM:
+        {
+            NUMERIC_OP(NUMBER_VAL, /);
+            break;
+        }
+        case OP_NEGATE_NUM:
+        {
+            VERIFY_OPERANDS(1, IS_NUMBER);
+            vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
+            break;
+        }
+        case OP_GREATER_INT:
+        {
+            INTEGER_COMPARE(>);
+            break;
+        }
+        case OP_LESS_INT:
+        {
+            INTEGER_COMPARE(<);
+            break;
+        }
+        case OP_ADD_INT:
+        {
+            INTEGER_OP(__builtin_add_overflow, +);
+            break;
+        }
+        case OP_SUBTRACT_INT:
+        {
+            INTEGER_OP(__builtin_sub_overflow, -);
+            break;
+        }
+        case OP_MULTIPLY_INT:
+        {
+            INTEGER_OP(__builtin_mul_overflow, *);
             break;
         }
         case OP_NOT:
         {
-            push(BOOL_VAL(isFalsey(pop())));
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
             break;
         }
         case OP_NEGATE:
         {
-            if (!IS_NUMBER(peek(0)))
+            Value operand = peek(vm, 0);
+            if (IS_INT(operand))
+            {
+                vm->stackTop[-1] = AS_INT(operand) == INT64_MIN ? NUMBER_VAL(-(double)INT64_MIN)
+                                                                : INT_VAL(-AS_INT(operand));
+            }
+            else if (IS_NUMERIC(operand))
+            {
+                vm->stackTop[-1] = NUMBER_VAL(-AS_FLOAT(operand));
+            }
+            else
             {
                 frame->ip = ip;
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return INTERPERT_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
             break;
         }
         case OP_PRINT:
         {
-            printValue(pop());
-            printf("\n");
+            flockfile(vm->out);
+            printValue(vm->out, pop(vm));
+            putc_unlocked('\n', vm->out);
+            funlockfile(vm->out);
             break;
         }
         case OP_POP:
         {
-            pop();
+            pop(vm);
             break;
         }
         case OP_POPN:
@@ -356,7 +778,7 @@ static InterpretResult run()
             uint8_t n = READ_BYTE();
             while (n > 0)
             {
-                pop();
+                pop(vm);
                 n--;
             }
             break;
@@ -364,63 +786,63 @@ static InterpretResult run()
         case OP_GET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
+            push(vm, frame->slots[slot]);
             break;
         }
         case OP_SET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
+            frame->slots[slot] = peek(vm, 0);
             break;
         }
         case OP_GET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            push(vm, *frame->closure->upvalues[slot]->location);
             break;
         }
         case OP_SET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            *frame->closure->upvalues[slot]->location = peek(vm, 0);
             break;
         }
         case OP_DEFINE_GLOBAL:
         {
             ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
+            tableSet(&vm->globals, name, peek(vm, 0));
+            pop(vm);
             break;
         }
         case OP_GET_GLOBAL:
         {
             ObjString *name = READ_STRING();
             Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            if (!tableGet(&vm->globals, name, &value))
             {
                 frame->ip = ip;
-                runtimeError("Undefined variable '%s'.", name->chars);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPERT_RUNTIME_ERROR;
             }
-            push(value);
+            push(vm, value);
             break;
         }
         case OP_SET_GLOBAL:
         {
             ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0)))
+            if (tableSet(&vm->globals, name, peek(vm, 0)))
             {
-                tableDelete(&vm.globals, name);
+                tableDelete(&vm->globals, name);
                 frame->ip = ip;
-                runtimeError("Undefined variable '%s'.", name->chars);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPERT_RUNTIME_ERROR;
             }
             break;
         }
         case OP_CLOSE_UPVALUE:
         {
-            closeUpValues(vm.stackTop - 1);
-            pop();
+            closeUpValues(vm, vm->stackTop - 1);
+            pop(vm);
             break;
         }
         case OP_JUMP:
@@ -432,33 +854,42 @@ static InterpretResult run()
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
+            if (isFalsey(peek(vm, 0)))
                 ip += offset;
             break;
         }
+        // only back-edges and calls burn fuel, so straight-line code is never
+        // metered and a script can't run long without passing one of them
         case OP_LOOP:
         {
             uint16_t offset = READ_SHORT();
             ip -= offset;
+            if (--vm->fuel < 0)
+            {
+                frame->ip = ip;
+                return INTERPRET_OUT_OF_FUEL;
+            }
             break;
         }
         case OP_CALL:
         {
             int argCount = READ_BYTE();
             frame->ip = ip;
-            if (!callValue(peek(argCount), argCount))
+            if (!callValue(vm, peek(vm, argCount), argCount))
             {
                 return INTERPERT_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
+            frame = &vm->frames[vm->frameCount - 1];
             ip = frame->ip;
+            if (--vm->fuel < 0)
+                return INTERPRET_OUT_OF_FUEL;
             break;
         }
         case OP_CLOSURE:
         {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
+            ObjClosure *closure = newClosure(vm, function);
+            push(vm, OBJ_VAL(closure));
 
             for (int i = 0; i < closure->upvalueCount; i++)
             {
@@ -466,7 +897,7 @@ static InterpretResult run()
                 uint8_t index = READ_BYTE();
                 if (isLocal)
                 {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
                 }
                 else
                 {
@@ -478,18 +909,27 @@ static InterpretResult run()
         }
         case OP_RETURN:
         {
-            Value result = pop();
-            closeUpValues(frame->slots);
-            vm.frameCount--;
-            if (vm.frameCount == 0)
+            Value result = pop(vm);
+            closeUpValues(vm, frame->slots);
+            vm->frameCount--;
+            if (vm->frameCount == 0 && vm->coroutine != NULL)
+            {
+                finishCoroutine(vm, result);
+                frame = &vm->frames[vm->frameCount - 1];
+                ip = frame->ip;
+                break;
+            }
+            if (vm->frameCount == 0)
             {
-                pop();
+                // the outermost call's result replaces its callee
+                vm->stackTop = frame->slots;
+                push(vm, result);
                 return INTERPRET_OK;
             }
 
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
+            vm->stackTop = frame->slots;
+            push(vm, result);
+            frame = &vm->frames[vm->frameCount - 1];
             ip = frame->ip;
             break;
         }
@@ -498,32 +938,96 @@ static InterpretResult run()
 
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef BINARY_OP
+#undef NUMBERS_ERROR
+#undef COMPARE_OP
+#undef ARITHMETIC_OP
+#undef BITWISE_OP
+#undef SHIFT_COUNT_CHECK
+#undef VERIFY_OPERANDS
+#undef NUMERIC_OP
+#undef INTEGER_COMPARE
+#undef INTEGER_OP
 #undef READ_STRING
 #undef READ_SHORT
 }
 
-InterpretResult interpret(const char *source)
+InterpretResult interpret(VM *vm, const char *source)
 {
-    ObjFunction *function = compile(source);
+    ObjFunction *function = compile(vm, source, false);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+    return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM *vm, ObjFunction *function)
+{
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
 
 #ifdef DEBUG_TRACE_EXECUTION
     printf("\n== start vm run logging ==\n");
 #endif
 
-    InterpretResult result = run();
+    return resumeInterpret(vm);
+}
+
+// drops a script stopped for fuel the way a runtime error would, so the vm
+// can take another one
+void abandonInterpret(VM *vm)
+{
+    resetStack(vm);
+}
+
+// runs until the script ends, or stops again once vm->fuel runs out. a
+// script that stopped carries on from where it was when the host calls this
+// again, having topped the fuel up
+InterpretResult resumeInterpret(VM *vm)
+{
+    InterpretResult result = run(vm);
+    if (result == INTERPRET_OK)
+        pop(vm);
 
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("\n== end vm run logging ==\n");
+    if (result != INTERPRET_OUT_OF_FUEL)
+        printf("\n== end vm run logging ==\n");
 #endif
 
     return result;
 }
+
+// the status a run that ended so exits the process with
+int exitStatus(InterpretResult result)
+{
+    switch (result)
+    {
+    case INTERPRET_COMPILE_ERROR:
+        return 65;
+    case INTERPERT_RUNTIME_ERROR:
+    case INTERPRET_OUT_OF_FUEL:
+        return 70;
+    default:
+        return 0;
+    }
+}
+
+// calls the value below argCount arguments on the stack of a vm that isn't
+// running anything, and hands back what the call returned
+InterpretResult interpretCall(VM *vm, int argCount, Value *result)
+{
+    if (!callValue(vm, peek(vm, argCount), argCount))
+        return INTERPERT_RUNTIME_ERROR;
+
+    // a native has already returned
+    if (vm->frameCount > 0)
+    {
+        InterpretResult status = run(vm);
+        if (status != INTERPRET_OK)
+            return status;
+    }
+    *result = pop(vm);
+    return INTERPRET_OK;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "number.h"
+
+// checks formatNumber's text against known cases and, for whole numbers
+// either side of 2^53, that it reads back exactly with as few digits as
+// any printf precision that does
+// usage: number_test
+
+static int failures = 0;
+
+static void expect(double value, const char *expected)
+{
+    char text[NUMBER_TEXT_MAX + 1];
+    int length = formatNumber(value, text);
+    text[length] = '\0';
+    if (strcmp(text, expected) != 0)
+    {
+        printf("%.17g: got %s, expected %s\n", value, text, expected);
+        failures++;
+    }
+}
+
+static int significantDigits(const char *text)
+{
+    int count = 0;
+    int trailingZeros = 0;
+    bool leading = true;
+    for (const char *c = text; *c != '\0' && *c != 'e'; c++)
+    {
+        if (*c < '0' || *c > '9' || (leading && *c == '0'))
+            continue;
+        leading = false;
+        count++;
+        trailingZeros = *c == '0' ? trailingZeros + 1 : 0;
+    }
+    return count - trailingZeros;
+}
+
+static void expectShortest(double value)
+{
+    char text[NUMBER_TEXT_MAX + 1];
+    int length = formatNumber(value, text);
+    text[length] = '\0';
+    if (strtod(text, NULL) != value)
+    {
+        printf("%.17g: got %s, which reads back as %.17g\n", value, text, strtod(text, NULL));
+        failures++;
+        return;
+    }
+
+    char shortest[40];
+    for (int precision = 1; precision <= 17; precision++)
+    {
+        snprintf(shortest, sizeof(shortest), "%.*e", precision - 1, value);
+        if (strtod(shortest, NULL) == value)
+            break;
+    }
+    if (significantDigits(text) > significantDigits(shortest))
+    {
+        printf("%.17g: got %s, but %s reads back too\n", value, text, shortest);
+        failures++;
+    }
+}
+
+int main()
+{
+    expect(0.0, "0");
+    expect(-0.0, "-0");
+    expect(0.1 + 0.2, "0.30000000000000004");
+    expect(1.0 / 3, "0.3333333333333333");
+    expect(1e-5, "1e-05");
+    expect(0.0001234, "0.0001234");
+    expect(123456.789, "123456.789");
+    expect(1000000.5, "1000000.5");
+
+    // 2^53 is the last whole number every digit of which is needed
+    expect(9007199254740991.0, "9007199254740991");
+    expect(9007199254740992.0, "9007199254740992");
+    expect(9007199254740994.0, "9007199254740994");
+    expect(98865873339407008.0, "98865873339407000");
+    expect(1e16, "10000000000000000");
+    expect(1e17, "1e+17");
+    expect(18446744073709551616.0, "1.8446744073709552e+19");
+    expect(1.7976931348623157e308, "1.7976931348623157e+308");
+    expect(5e-324, "5e-324");
+
+    // whole doubles from 2^50 to 2^64, and the gaps around powers of two
+    srand(1);
+    for (int exponent = 50; exponent < 64; exponent++)
+    {
+        double power = (double)(1ull << exponent);
+        expectShortest(power);
+        expectShortest(power - (power > 9007199254740992.0 ? power / 9007199254740992.0 : 1));
+        for (int i = 0; i < 10000; i++)
+        {
+            uint64_t bits = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+            expectShortest(power + (double)(bits & ((1ull << 52) - 1)) * (power / 4503599627370496.0));
+        }
+    }
+
+    if (failures > 0)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}